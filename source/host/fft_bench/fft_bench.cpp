@@ -0,0 +1,195 @@
+// Host benchmark of arduinoFFT and the detection kernels in src/dsp.hpp.
+// Prints one CSV row per measurement:
+//   variant,type,samples,stage,window,ns
+// where 'ns' is the best mean time per call over several runs, or -1 when the
+// kernel could not be set up for that size (the reason goes to stderr).
+
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define BENCH_MIN_SAMPLES 64
+#define BENCH_MAX_SAMPLES 4096
+
+// The detection kernels are measured up to the largest benchmark size, beyond
+// the 2048 points the firmware allows
+#define ANALYSIS_MAX_SAMPLES BENCH_MAX_SAMPLES
+
+#include "dsp.hpp"
+
+#ifndef BENCH_VARIANT
+#define BENCH_VARIANT "default"
+#endif
+
+#define BENCH_RUNS 5
+#define BENCH_RUN_NS 20000000.0 // Each run repeats the call for at least 20 ms
+
+template <typename T> const char *typeName();
+template <> const char *typeName<float>() { return "float"; }
+template <> const char *typeName<double>() { return "double"; }
+
+static double elapsedNs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Best mean time per call of 'body'. 'restore' resets the input before every
+// call, because most kernels work in place; its own cost is measured and
+// subtracted.
+static double measure(const std::function<void()> &restore, const std::function<void()> &body)
+{
+    long iterations = 1;
+    for (;;)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++)
+        {
+            restore();
+            body();
+        }
+        if (elapsedNs(start) >= BENCH_RUN_NS / 10)
+            break;
+        iterations *= 2;
+    }
+    iterations *= 10;
+
+    double best = 0.0;
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++)
+            restore();
+        double restoreNs = elapsedNs(start);
+
+        start = std::chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++)
+        {
+            restore();
+            body();
+        }
+        double ns = (elapsedNs(start) - restoreNs) / iterations;
+        if (run == 0 || ns < best)
+            best = ns;
+    }
+    return best < 0.0 ? 0.0 : best;
+}
+
+static void report(const char *type, int samples, const char *stage, const char *window, double ns)
+{
+    printf("%s,%s,%d,%s,%s,%.1f\n", BENCH_VARIANT, type, samples, stage, window, ns);
+    fflush(stdout);
+}
+
+// A 440 Hz tone with a little noise, roughly what the microphone delivers
+template <typename T> static void makeSignal(std::vector<T> &signal)
+{
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < signal.size(); i++)
+    {
+        seed = seed * 1103515245u + 12345u;
+        T noise = (T)((int)(seed >> 16 & 0x7FFF) - 16384) / (T)1638400;
+        signal[i] = (T)(0.3 * sin(twoPi * 440.0 * i / SAMPLING_FREQUENCY)) + noise;
+    }
+}
+
+template <typename T> static void benchFFT()
+{
+    ArduinoFFT<T> fft;
+    const char *type = typeName<T>();
+
+    for (int samples = BENCH_MIN_SAMPLES; samples <= BENCH_MAX_SAMPLES; samples *= 2)
+    {
+        std::vector<T> signal(samples), real(samples), imag(samples);
+        makeSignal(signal);
+        auto restore = [&]() {
+            memcpy(real.data(), signal.data(), samples * sizeof(T));
+            memset(imag.data(), 0, samples * sizeof(T));
+        };
+
+        // windowNames follows the order of FFTWindow
+        for (size_t window = 0; window < WINDOW_COUNT; window++)
+        {
+            report(type, samples, "windowing", windowNames[window], measure(restore, [&]() {
+                       fft.windowing(real.data(), samples, (FFTWindow)window, FFTDirection::Forward);
+                   }));
+        }
+
+        report(type, samples, "compute", "-", measure(restore, [&]() {
+                   fft.compute(real.data(), imag.data(), samples, FFTDirection::Forward);
+               }));
+
+        report(type, samples, "magnitude", "-", measure(restore, [&]() {
+                   fft.complexToMagnitude(real.data(), imag.data(), samples);
+               }));
+
+        report(type, samples, "major_peak", "-", measure(restore, [&]() {
+                   fft.majorPeak(real.data(), samples, (T)SAMPLING_FREQUENCY);
+               }));
+    }
+}
+
+// The detect.hpp kernels, which only exist for float
+static void benchDetector()
+{
+    arenaSetup(DSP_ARENA_BYTES(BENCH_MAX_SAMPLES));
+    for (int samples = BENCH_MIN_SAMPLES; samples <= BENCH_MAX_SAMPLES; samples *= 2)
+    {
+        // analyseSpectrum() needs its window table sized for this frame
+        AnalysisConfig config = defaultAnalysisConfig;
+        config.samples = samples;
+        config.engine = ENGINE_FIXED;
+        const char *error = dspConfigure(config);
+
+        std::vector<float> signal(samples), real(samples), imag(samples);
+        std::vector<i2s_sample_t> raw(samples);
+        makeSignal(signal);
+        for (int i = 0; i < samples; i++)
+        {
+#if I2S_SAMPLE_BITS == 16
+            raw[i ^ 1] = (i2s_sample_t)(signal[i] * I2S_SAMPLE_SCALE);
+#else
+            raw[i] = (i2s_sample_t)(signal[i] * I2S_SAMPLE_SCALE) * 256;
+#endif
+        }
+        auto restore = [&]() { memcpy(real.data(), signal.data(), samples * sizeof(float)); };
+        auto nothing = []() {};
+        volatile float sink = 0.0f;
+
+        report("float", samples, "convert_i2s", "-", measure(nothing, [&]() {
+                   convertI2SToFloat(raw.data(), real.data(), samples);
+               }));
+
+        report("float", samples, "high_pass", "-", measure(restore, [&]() {
+                   HighPassState state = {0.0f, 0.0f};
+                   sink = applyHighPassFilter(real.data(), samples, state);
+               }));
+
+        report("float", samples, "rms", "-", measure(nothing, [&]() {
+                   sink = calculateRMS(signal.data(), samples);
+               }));
+
+        if (error == NULL)
+        {
+            report("float", samples, "analyse_spectrum", "hamming", measure(restore, [&]() {
+                       sink = analyseSpectrum(real.data(), imag.data(), samples);
+                   }));
+        }
+        else
+        {
+            fprintf(stderr, "analyse_spectrum at %d samples skipped: %s\n", samples, error);
+            report("float", samples, "analyse_spectrum", "hamming", -1.0);
+        }
+        (void)sink;
+    }
+}
+
+int main()
+{
+    printf("variant,type,samples,stage,window,ns\n");
+    benchFFT<float>();
+    benchFFT<double>();
+    benchDetector();
+    return 0;
+}
@@ -0,0 +1,406 @@
+// Replays a WAV take through the detector kernels of src/dsp.hpp, frame by
+// frame and with the same adaptive stages as detect_loop(), as fast as the host
+// allows, and feeds the result through the pitch tracker of src/pitchtrack.hpp.
+//
+//   replay [-a min_accuracy] [-c settings] take.wav [labels.txt]
+//
+// 'settings' change the analysis configuration like the 'c' serial command,
+// e.g. -c "samples=1024 window=hann engine=fixed".
+//
+// The detected event stream goes to stdout as CSV:
+//   time,samples,frequency,midi,note,cents,rms,cpu_us,tracked
+// 'time' is when the frame's last sample arrived, in seconds from the start;
+// 'tracked' is the note the pitch tracker would sound, -1 for silence.
+//
+// The labels are an Audacity label track: "start<TAB>end<TAB>note" per line,
+// with times in seconds and the note as a MIDI number or a name like A4 or C#5.
+// With labels, a summary goes to stderr and the exit status is 1 when the
+// note accuracy is below min_accuracy.
+
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "dsp.hpp"
+#include "quantize.hpp"
+#include "pitchtrack.hpp"
+
+struct Label
+{
+    double start;
+    double end;
+    int midi;
+};
+
+struct Frame
+{
+    double startTime;
+    double time; // When the last sample of the frame arrived
+    int samples;
+    float frequency;
+    QuantizedNote note;
+    int tracked;
+    float rms;
+    double cpuUs;
+};
+
+static uint32_t readLittleEndian(const uint8_t *bytes, int count)
+{
+    uint32_t value = 0;
+    for (int i = count - 1; i >= 0; i--)
+        value = value << 8 | bytes[i];
+    return value;
+}
+
+// Loads a PCM mono WAV file as 24-bit signed samples, like record_audio_to_wav() writes them
+static bool loadWav(const char *path, std::vector<int32_t> &samples)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t length;
+    while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        data.insert(data.end(), chunk, chunk + length);
+    fclose(file);
+
+    if (data.size() < 12 || memcmp(&data[0], "RIFF", 4) != 0 || memcmp(&data[8], "WAVE", 4) != 0)
+    {
+        fprintf(stderr, "%s is not a WAV file\n", path);
+        return false;
+    }
+
+    int channels = 0, rate = 0, bits = 0, format = 0;
+    size_t position = 12;
+    while (position + 8 <= data.size())
+    {
+        uint32_t size = readLittleEndian(&data[position + 4], 4);
+        const uint8_t *body = &data[position + 8];
+        size_t available = std::min<size_t>(size, data.size() - position - 8);
+
+        if (memcmp(&data[position], "fmt ", 4) == 0 && available >= 16)
+        {
+            format = readLittleEndian(body, 2);
+            channels = readLittleEndian(body + 2, 2);
+            rate = readLittleEndian(body + 4, 4);
+            bits = readLittleEndian(body + 14, 2);
+        }
+        else if (memcmp(&data[position], "data", 4) == 0)
+        {
+            if (format != 1 || channels != 1 || rate != analysisConfig.samplingFrequency ||
+                (bits != 16 && bits != 24 && bits != 32))
+            {
+                fprintf(stderr, "%s: need PCM mono %d Hz with 16, 24 or 32 bits, got format %d, %d channels, %d Hz, %d bits\n",
+                        path, analysisConfig.samplingFrequency, format, channels, rate, bits);
+                return false;
+            }
+            int bytes = bits / 8;
+            for (size_t i = 0; i + bytes <= available; i += bytes)
+            {
+                // Place the sample in the top bits to sign-extend it, then keep 24 bits
+                int32_t sample = (int32_t)(readLittleEndian(body + i, bytes) << (32 - bits));
+                samples.push_back(sample >> 8);
+            }
+            return true;
+        }
+        position += 8 + size + (size & 1);
+    }
+    fprintf(stderr, "%s has no audio data\n", path);
+    return false;
+}
+
+// MIDI number of "69", "A4", "C#5" or "Bb3"; -1 if unknown
+static int parseNote(const char *text)
+{
+    char *end;
+    long number = strtol(text, &end, 10);
+    if (end != text && *end == '\0')
+        return number >= 0 && number < MIDI_NOTE_COUNT ? (int)number : -1;
+
+    const int semitones[] = {9, 11, 0, 2, 4, 5, 7}; // A..G
+    char letter = text[0] & ~0x20;
+    if (letter < 'A' || letter > 'G')
+        return -1;
+    int semitone = semitones[letter - 'A'];
+    const char *p = text + 1;
+    if (*p == '#')
+        semitone++, p++;
+    else if (*p == 'b')
+        semitone--, p++;
+    long octave = strtol(p, &end, 10);
+    if (end == p || *end != '\0')
+        return -1;
+    int midi = (int)(octave + 1) * 12 + semitone;
+    return midi >= 0 && midi < MIDI_NOTE_COUNT ? midi : -1;
+}
+
+static bool loadLabels(const char *path, std::vector<Label> &labels)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    char line[256];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+        Label label;
+        char name[64];
+        if (line[0] == '#' || line[0] == '\\' || strspn(line, " \t\r\n") == strlen(line))
+            continue; // Comments, Audacity frequency lines and blank lines
+        if (sscanf(line, "%lf %lf %63s", &label.start, &label.end, name) != 3 ||
+            (label.midi = parseNote(name)) < 0)
+        {
+            fprintf(stderr, "%s:%d: expected \"start end note\"\n", path, lineNumber);
+            fclose(file);
+            return false;
+        }
+        labels.push_back(label);
+    }
+    fclose(file);
+    std::sort(labels.begin(), labels.end(), [](const Label &a, const Label &b) { return a.start < b.start; });
+    return true;
+}
+
+// Runs the take through the configured stages, as detect_loop() does with live audio
+static void replay(const std::vector<int32_t> &audio, std::vector<Frame> &frames)
+{
+    int rate = analysisConfig.samplingFrequency;
+    i2s_sample_t *buffer = arenaAllocate<i2s_sample_t>(analysisConfig.samples);
+    float *real = arenaAllocate<float>(analysisConfig.samples);
+    float *imag = arenaAllocate<float>(analysisConfig.samples);
+    HighPassState highPassState = {0.0f, 0.0f};
+    size_t position = 0;
+
+    for (;;)
+    {
+        Frame frame = {};
+        frame.startTime = (double)position / rate;
+        bool complete = false;
+
+        for (size_t stage = 0; stage < analysisStageCount; stage++)
+        {
+            int samples = analysisStages[stage];
+            if (position + samples > audio.size())
+                break;
+
+            // Hand the samples over in the layout the I2S driver delivers them in
+            for (int i = 0; i < samples; i++)
+            {
+#if I2S_SAMPLE_BITS == 16
+                buffer[i ^ 1] = (i2s_sample_t)(audio[position + i] >> 8);
+#else
+                buffer[i] = (i2s_sample_t)((uint32_t)audio[position + i] << 8);
+#endif
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            HighPassState state = highPassState;
+            frame.frequency = analyseWindow(buffer, real, imag, samples, state, frame.rms);
+            frame.cpuUs += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            frame.samples = samples;
+
+            if (analysisStageDone(stage, frame.frequency, samples))
+            {
+                highPassState = state;
+                frame.note = frame.frequency > 0.0f ? quantizeFrequency(frame.frequency) : QuantizedNote{-1, 0, 0, ""};
+                frame.time = (double)(position + samples) / rate;
+                frame.tracked = pitchTrackUpdate(frame.frequency, (uint32_t)(frame.time * 1e6));
+                char name[8] = "";
+                if (frame.note.midi >= 0)
+                    snprintf(name, sizeof(name), "%s%d", frame.note.name, frame.note.octave);
+                printf("%.4f,%d,%.2f,%d,%s,%d,%.6f,%.1f,%d\n", frame.time, samples, frame.frequency, frame.note.midi,
+                       name, frame.note.cents, frame.rms, frame.cpuUs, frame.tracked);
+                complete = true;
+                break;
+            }
+        }
+        if (!complete)
+            return;
+        frames.push_back(frame);
+        position += frame.samples;
+    }
+}
+
+// The label sounding at 'time', or NULL in a pause
+static const Label *labelAt(const std::vector<Label> &labels, double time)
+{
+    for (const Label &label : labels)
+    {
+        if (time >= label.start && time < label.end)
+            return &label;
+    }
+    return NULL;
+}
+
+static double percentile(std::vector<double> values, double fraction)
+{
+    if (values.empty())
+        return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t)(fraction * (values.size() - 1) + 0.5);
+    return values[index];
+}
+
+// Frame scores use the label at the middle of each frame and the detected note;
+// latency runs from a label's start to the end of the first frame the tracker
+// sounds its note in, which is when playNote() would send it
+static double score(const std::vector<Frame> &frames, const std::vector<Label> &labels)
+{
+    int voiced = 0, correct = 0, octaveErrors = 0, otherErrors = 0, missed = 0;
+    int unvoiced = 0, falseNotes = 0;
+    for (const Frame &frame : frames)
+    {
+        const Label *label = labelAt(labels, (frame.startTime + frame.time) / 2.0);
+        if (label == NULL)
+        {
+            unvoiced++;
+            if (frame.note.midi >= 0)
+                falseNotes++;
+            continue;
+        }
+        voiced++;
+        if (frame.note.midi == label->midi)
+            correct++;
+        else if (frame.note.midi < 0)
+            missed++;
+        else if ((frame.note.midi - label->midi) % 12 == 0)
+            octaveErrors++;
+        else
+            otherErrors++;
+    }
+
+    std::vector<double> latencies;
+    int undetected = 0;
+    for (const Label &label : labels)
+    {
+        bool found = false;
+        for (const Frame &frame : frames)
+        {
+            if (frame.time > label.start && frame.startTime < label.end && frame.tracked == label.midi)
+            {
+                latencies.push_back((frame.time - label.start) * 1000.0 + frame.cpuUs / 1000.0);
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            undetected++;
+    }
+
+    // Note on, off and change messages playNote() would send without and with the tracker,
+    // and the velocity of each tracked note on at the default dynamics range
+    int rawMessages = 0, trackedMessages = 0, noteOns = 0;
+    std::vector<int> velocities;
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        int rawBefore = i > 0 ? frames[i - 1].note.midi : -1;
+        int trackedBefore = i > 0 ? frames[i - 1].tracked : -1;
+        rawMessages += frames[i].note.midi != rawBefore;
+        trackedMessages += frames[i].tracked != trackedBefore;
+        if (frames[i].tracked >= 0 && frames[i].tracked != trackedBefore)
+        {
+            noteOns++;
+            velocities.push_back(quantizeLevel(rmsToLevel(frames[i].rms), DYNAMICS_RANGE_DB));
+        }
+    }
+    std::vector<int> distinct = velocities;
+    std::sort(distinct.begin(), distinct.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+
+    std::vector<double> cpu;
+    for (const Frame &frame : frames)
+        cpu.push_back(frame.cpuUs);
+
+    double accuracy = voiced > 0 ? (double)correct / voiced : 0.0;
+    fprintf(stderr, "frames: %zu, voiced %d, unvoiced %d\n", frames.size(), voiced, unvoiced);
+    fprintf(stderr, "note accuracy: %.4f (%d of %d)\n", accuracy, correct, voiced);
+    fprintf(stderr, "octave errors: %d, other wrong notes: %d, missed: %d, notes in pauses: %d\n",
+            octaveErrors, otherErrors, missed, falseNotes);
+    fprintf(stderr, "onset latency ms: mean %.1f, p99 %.1f, max %.1f (%zu notes, %d never detected)\n",
+            latencies.empty() ? 0.0 : std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size(),
+            percentile(latencies, 0.99), latencies.empty() ? 0.0 : *std::max_element(latencies.begin(), latencies.end()),
+            labels.size(), undetected);
+    fprintf(stderr, "note changes: raw %d, tracked %d (%u suppressed, %u dropouts bridged)\n", rawMessages,
+            trackedMessages, pitchTrackStats.suppressedChanges, pitchTrackStats.bridgedDropouts);
+    fprintf(stderr, "tracked note ons: %d for %zu labelled notes\n", noteOns, labels.size());
+    fprintf(stderr, "velocity: min %d, mean %.1f, max %d, %zu distinct values (%zu note ons)\n",
+            distinct.empty() ? 0 : distinct.front(),
+            velocities.empty() ? 0.0 : (double)std::accumulate(velocities.begin(), velocities.end(), 0) / velocities.size(),
+            distinct.empty() ? 0 : distinct.back(), distinct.size(), velocities.size());
+    fprintf(stderr, "host cpu us per frame: mean %.1f, p99 %.1f, max %.1f\n",
+            cpu.empty() ? 0.0 : std::accumulate(cpu.begin(), cpu.end(), 0.0) / cpu.size(),
+            percentile(cpu, 0.99), cpu.empty() ? 0.0 : *std::max_element(cpu.begin(), cpu.end()));
+    return accuracy;
+}
+
+int main(int argc, char **argv)
+{
+    double minAccuracy = 0.0;
+    AnalysisConfig config = defaultAnalysisConfig;
+    int argument = 1;
+    while (argc - argument > 1 && argv[argument][0] == '-')
+    {
+        if (strcmp(argv[argument], "-a") == 0)
+            minAccuracy = atof(argv[argument + 1]);
+        else if (strcmp(argv[argument], "-c") == 0)
+        {
+            const char *error = parseAnalysisConfig(argv[argument + 1], config);
+            if (error != NULL)
+            {
+                fprintf(stderr, "%s\n", error);
+                return 2;
+            }
+        }
+        else
+            break;
+        argument += 2;
+    }
+    if (argc - argument < 1 || argc - argument > 2 || argv[argument][0] == '-')
+    {
+        fprintf(stderr, "usage: %s [-a min_accuracy] [-c settings] take.wav [labels.txt]\n", argv[0]);
+        return 2;
+    }
+
+    // The kernel tables plus the three frame buffers replay() carves
+    arenaSetup(DSP_ARENA_BYTES(ANALYSIS_MAX_SAMPLES) + 3 * 16 +
+               ANALYSIS_MAX_SAMPLES * (2 * sizeof(float) + sizeof(i2s_sample_t)));
+    const char *error = dspConfigure(config);
+    if (error != NULL)
+    {
+        fprintf(stderr, "%s\n", error);
+        return 2;
+    }
+
+    std::vector<int32_t> audio;
+    std::vector<Label> labels;
+    if (!loadWav(argv[argument], audio))
+        return 2;
+    if (argc - argument == 2 && !loadLabels(argv[argument + 1], labels))
+        return 2;
+
+    std::vector<Frame> frames;
+    printf("time,samples,frequency,midi,note,cents,rms,cpu_us,tracked\n");
+    replay(audio, frames);
+
+    if (argc - argument < 2)
+        return 0;
+    double accuracy = score(frames, labels);
+    if (accuracy < minAccuracy)
+    {
+        fprintf(stderr, "FAIL: note accuracy %.4f below %.4f\n", accuracy, minAccuracy);
+        return 1;
+    }
+    return 0;
+}
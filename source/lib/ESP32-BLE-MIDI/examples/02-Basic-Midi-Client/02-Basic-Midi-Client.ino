@@ -12,6 +12,11 @@ void setup() {
 
 void loop() {
     if(!BLEMidiClient.isConnected()) {
+        // A device we have been connected to before is reconnected without scanning
+        if(BLEMidiClient.connectToKnownDevice()) {
+            Serial.println("Reconnected");
+            return;
+        }
         // If we are not already connected, we try te connect to the first BLE Midi device we find
         int nDevices = BLEMidiClient.scan();
         if(nDevices > 0) {
@@ -0,0 +1,51 @@
+#include <Arduino.h>
+#include <BLEMidi.h>
+
+// Sends a block of data to the connected central every 10 seconds, and receives blocks the
+// central sends the same way (see MidiBulkTransfer.h for the protocol)
+
+MidiBulkTransfer bulk(BLEMidiServer);
+uint8_t sysExBuffer[MIDI_BULK_SYSEX_BUFFER];
+uint8_t receiveBuffer[8192];
+uint8_t table[4096];
+
+void onReceived(uint8_t type, const uint8_t *data, size_t size)
+{
+  Serial.printf("Received %u bytes of type %d in %u ms\n", size, type, bulk.getStats().lastTransferMs);
+}
+
+void onSent(MidiBulkTransfer::AbortReason reason)
+{
+  if(reason == MidiBulkTransfer::ABORT_NONE)
+    Serial.printf("Sent %u bytes in %u ms\n", bulk.getStats().lastTransferBytes, bulk.getStats().lastTransferMs);
+  else
+    Serial.printf("Transfer failed, reason %d\n", reason);
+}
+
+void setup() {
+  Serial.begin(115200);
+  for(int i = 0; i < sizeof(table); i++)
+    table[i] = i;
+  BLEMidiServer.begin("MIDI device");
+  BLEMidiServer.setSysExBuffer(sysExBuffer, sizeof(sysExBuffer));
+  BLEMidiServer.setSysExCallback([](const uint8_t *data, size_t size, uint16_t timestamp) {
+    bulk.handleSysEx(data, size);
+  });
+  // Callbacks on the loop task, like update()
+  BLEMidiServer.enableReceiveQueue();
+  bulk.setReceiveBuffer(receiveBuffer, sizeof(receiveBuffer));
+  bulk.setOnReceived(onReceived);
+  bulk.setOnSent(onSent);
+}
+
+void loop() {
+  static uint32_t lastSend = 0;
+  BLEMidiServer.update();   // Packet size follows the MTU, so chunks fill the packets
+  BLEMidiServer.processReceived();
+  bulk.update();
+  if (BLEMidiServer.isConnected() && !bulk.isSending() && millis() - lastSend > 10000) {
+    lastSend = millis();
+    bulk.send(1, table, sizeof(table));
+  }
+  delay(1);
+}
@@ -3,5 +3,6 @@
 
 #include "utility/BLEMidiServer.h"
 #include "utility/BLEMidiClient.h"
+#include "utility/MidiBulkTransfer.h"
 
 #endif
\ No newline at end of file
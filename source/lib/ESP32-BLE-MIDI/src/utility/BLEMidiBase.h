@@ -13,7 +13,7 @@ public:
 
 protected:
     std::string deviceName;
-    bool connected = false;
+    std::atomic<bool> connected{false};  // Written by the BLE host task and the reconnection task
     const std::string MIDI_SERVICE_UUID = "03b80e5a-ede8-4b33-a751-6ce34ec4c700";
     const std::string MIDI_CHARACTERISTIC_UUID = "7772e5db-3868-4112-a1a9-f2669d106bf3";
 };
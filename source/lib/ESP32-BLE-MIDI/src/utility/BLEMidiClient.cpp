@@ -3,39 +3,118 @@
 void BLEMidiClientClass::begin(const std::string deviceName)
 {
     BLEMidi::begin(deviceName);
+    registry.load();
+    if(linkLock == nullptr)
+        linkLock = xSemaphoreCreateMutex();
+    if(scanDone == nullptr)
+        scanDone = xSemaphoreCreateBinary();
 }
 
 int BLEMidiClientClass::scan()
 {
-    debug.println("Beginning scan...");
+    if(scanDone == nullptr || scanning)
+        return 0;
+    // Drops the completion of a previous background scan nobody waited for
+    xSemaphoreTake(scanDone, 0);
+    if(!startScan(3, false))
+        return 0;
+    // Given by finishScan(); the margin covers the host task ending the scan late
+    if(xSemaphoreTake(scanDone, pdMS_TO_TICKS(3 * 1000 + 500)) != pdTRUE) {
+        stopScan();
+        xSemaphoreTake(scanDone, pdMS_TO_TICKS(500));
+    }
+    return foundMidiDevices.size();
+}
+
+bool BLEMidiClientClass::startScan(uint32_t seconds, bool stopOnMatch)
+{
+    if(scanning)
+        return false;
+    MIDI_DEBUG_PRINTLN("Beginning scan...");
     pBLEScan = BLEDevice::getScan();
     if(pBLEScan == nullptr)
-        return 0;
+        return false;
+    pBLEScan->setAdvertisedDeviceCallbacks(this, false);
+    pBLEScan->setMaxResults(0);     // Only MIDI devices are kept, in foundMidiDevices
     pBLEScan->setActiveScan(true);
     pBLEScan->setInterval(100);
     pBLEScan->setWindow(99);
     pBLEScan->clearResults();
     foundMidiDevices.clear();
-    BLEScanResults foundDevices = pBLEScan->start(3);
-    debug.printf("Found %d BLE device(s)\n", foundDevices.getCount());
-    for(int i=0; i<foundDevices.getCount(); i++) {
-        BLEAdvertisedDevice device = foundDevices.getDevice(i);
-        auto deviceStr = "name = \"" + device.getName() + "\", address = "  + device.getAddress().toString();
-        if (device.haveServiceUUID() && device.isAdvertisingService(BLEUUID(MIDI_SERVICE_UUID))) {
-            debug.println((" - BLE MIDI device : " + deviceStr).c_str());
-            foundMidiDevices.push_back(device);
-        }
-        else
-            debug.println((" - Other type of BLE device : " + deviceStr).c_str());
-        debug.printf("Total of BLE MIDI devices : %d\n", foundMidiDevices.size());
+    this->stopOnMatch = stopOnMatch;
+    scanning = true;
+    if(!pBLEScan->start(seconds, onScanComplete, false)) {
+        scanning = false;
+        return false;
     }
-    return foundMidiDevices.size();
+    return true;
+}
+
+void BLEMidiClientClass::stopScan()
+{
+    if(scanning && pBLEScan != nullptr)
+        pBLEScan->stop();
+}
+
+bool BLEMidiClientClass::isScanning()
+{
+    return scanning;
+}
+
+void BLEMidiClientClass::setScanFilter(const std::string name)
+{
+    scanFilter = name;
+}
+
+void BLEMidiClientClass::setOnScanResult(void (*const onScanResultCallback)(BLEAdvertisedDevice*, bool))
+{
+    this->onScanResultCallback = onScanResultCallback;
+}
+
+void BLEMidiClientClass::setOnScanComplete(void (*const onScanCompleteCallback)(int))
+{
+    this->onScanCompleteCallback = onScanCompleteCallback;
+}
+
+void BLEMidiClientClass::onResult(BLEAdvertisedDevice *device)
+{
+    if(!scanning || !device->haveServiceUUID() || !device->isAdvertisingService(BLEUUID(MIDI_SERVICE_UUID)))
+        return;
+    BLEAddress address = device->getAddress();
+    bool known = registry.find(address) >= 0 || BLEDevice::isBonded(address);
+    if(!known && !scanFilter.empty() && device->getName() != scanFilter)
+        return;
+    MIDI_DEBUG_PRINTF(" - BLE MIDI device : name = \"%s\", address = %s%s\n", device->getName().c_str(),
+        address.toString().c_str(), known ? " (known)" : "");
+    foundMidiDevices.push_back(*device);
+    if(onScanResultCallback != nullptr)
+        onScanResultCallback(device, known);
+    // Any MIDI device that got this far matches: it is known, or passed the name filter
+    if(stopOnMatch)
+        pBLEScan->stop();
+}
+
+void BLEMidiClientClass::onScanComplete(BLEScanResults results)
+{
+    BLEMidiClient.finishScan(); // We call the member function of the only instantiated class.
+}
+
+void BLEMidiClientClass::finishScan()
+{
+    if(!scanning)
+        return;
+    scanning = false;
+    MIDI_DEBUG_PRINTF("Total of BLE MIDI devices : %d\n", (int)foundMidiDevices.size());
+    if(onScanCompleteCallback != nullptr)
+        onScanCompleteCallback(foundMidiDevices.size());
+    if(scanDone != nullptr)
+        xSemaphoreGive(scanDone);
 }
 
 BLEAdvertisedDevice* BLEMidiClientClass::getScannedDevice(uint32_t deviceIndex)
 {
     if(deviceIndex >= foundMidiDevices.size()) {
-        debug.println("Scanned device not found because requested index is greater than the devices list");
+        MIDI_DEBUG_PRINTLN("Scanned device not found because requested index is greater than the devices list");
         return nullptr;
     }
     return &foundMidiDevices.at(deviceIndex);
@@ -43,44 +122,240 @@ BLEAdvertisedDevice* BLEMidiClientClass::getScannedDevice(uint32_t deviceIndex)
 
 bool BLEMidiClientClass::connect(uint32_t deviceIndex)
 {
-    debug.printf("Connecting to device number %d\n", deviceIndex);
+    MIDI_DEBUG_PRINTF("Connecting to device number %d\n", deviceIndex);
     if(deviceIndex >= foundMidiDevices.size()) {
-        debug.println("Cannot connect : device index is greater than the size of the MIDI devices lists.");
+        MIDI_DEBUG_PRINTLN("Cannot connect : device index is greater than the size of the MIDI devices lists.");
         return false;
     }
-    BLEAdvertisedDevice* device = new BLEAdvertisedDevice(foundMidiDevices.at(deviceIndex));
-    if(device == nullptr)
+    BLEAdvertisedDevice& device = foundMidiDevices.at(deviceIndex);
+    return connectTo(device.getAddress(), device.getName());
+}
+
+bool BLEMidiClientClass::connect(const BLEAddress &address)
+{
+    return connectTo(address, "");
+}
+
+bool BLEMidiClientClass::connectToKnownDevice()
+{
+    for(size_t i = 0; i < registry.count(); i++) {
+        const BLEMidiKnownDevice *device = registry.get(i);
+        MIDI_DEBUG_PRINTF("Trying known device \"%s\"\n", device->name);
+        // connectTo() moves the device to the front of the list, so this is the last iteration
+        if(connectTo(BLEMidiDeviceRegistry::addressOf(*device), ""))
+            return true;
+    }
+    return false;
+}
+
+int BLEMidiClientClass::getKnownDeviceCount()
+{
+    return registry.count();
+}
+
+const BLEMidiKnownDevice* BLEMidiClientClass::getKnownDevice(uint32_t deviceIndex)
+{
+    return registry.get(deviceIndex);
+}
+
+bool BLEMidiClientClass::forgetDevice(const BLEAddress &address)
+{
+    return registry.forget(address);
+}
+
+void BLEMidiClientClass::forgetAllDevices()
+{
+    registry.clear();
+}
+
+bool BLEMidiClientClass::connectTo(const BLEAddress &address, const std::string &name)
+{
+    if(linkLock == nullptr)
+        return false;
+    xSemaphoreTake(linkLock, portMAX_DELAY);
+    bool result = connectLocked(address, name);
+    xSemaphoreGive(linkLock);
+    return result;
+}
+
+bool BLEMidiClientClass::connectLocked(const BLEAddress &address, const std::string &name)
+{
+    if(scanning)
+        stopScan();
+    bool reconnecting = linkState.load() == LINK_LOST && address == peerAddress;
+    if(!openLink(address)) {
+        statFailedConnects.fetch_add(1, std::memory_order_relaxed);
+        statFreeHeap.store(ESP.getFreeHeap(), std::memory_order_relaxed);
+        return false;
+    }
+    registry.remember(address, name);
+    uint32_t freeHeap = ESP.getFreeHeap();
+    statFreeHeap.store(freeHeap, std::memory_order_relaxed);
+    if(statConnects.fetch_add(1, std::memory_order_relaxed) == 0)
+        statFirstConnectHeap.store(freeHeap, std::memory_order_relaxed);
+    if(reconnecting) {
+        uint32_t reconnectMs = millis() - lostMs.load();
+        statReconnects.fetch_add(1, std::memory_order_relaxed);
+        statLastReconnectMs.store(reconnectMs, std::memory_order_relaxed);
+        if(reconnectMs > statMaxReconnectMs.load(std::memory_order_relaxed))
+            statMaxReconnectMs.store(reconnectMs, std::memory_order_relaxed);
+        MIDI_DEBUG_PRINTF("Reconnected in %d ms\n", reconnectMs);
+    }
+    linkState.store(LINK_CONNECTED);
+    connected = true;
+    if(onConnectCallback != nullptr)
+        onConnectCallback();
+    return true;
+}
+
+bool BLEMidiClientClass::openLink(const BLEAddress &address)
+{
+    if(pClient == nullptr) {
+        pClient = BLEDevice::createClient();
+        if(pClient == nullptr)
+            return false;
+        pClient->setClientCallbacks(this, false);
+        pClient->setConnectTimeout(BLE_MIDI_CONNECT_TIMEOUT);
+    }
+    if(pClient->isConnected()) {
+        if(connected && address == peerAddress)
+            return true;
+        MIDI_DEBUG_PRINTLN("Cannot connect : already connected");
+        return false;
+    }
+    MIDI_DEBUG_PRINTF("Address of the device : %s\n", address.toString().c_str());
+    // The remote attributes of the previous connection are kept when it is the same device,
+    // which saves the service discovery
+    bool samePeer = attributesCached && address == peerAddress;
+    if(!samePeer) {
+        attributesCached = false;
+        pRemoteCharacteristic = nullptr;
+        peerAddress = address;
+    }
+    MIDI_DEBUG_PRINTLN("pClient->connect()");
+    if(!pClient->connect(address, !samePeer))
         return false;
-    debug.printf("Address of the device : %s\n", device->getAddress().toString().c_str());
-    BLEClient* pClient = BLEDevice::createClient();
-    pClient->setClientCallbacks(new ClientCallbacks(connected, onConnectCallback, onDisconnectCallback));
-    debug.println("pClient->connect()");
-    if(!pClient->connect(device))
+    if(!attributesCached && !findCharacteristic()) {
+        pClient->disconnect();
         return false;
-    debug.println("pClient->getService()");
+    }
+    MIDI_DEBUG_PRINTLN("Registering characteristic callback");
+    if(!subscribe() && samePeer) {
+        // The device may have changed its attributes since: discover them again
+        pClient->deleteServices();
+        attributesCached = false;
+        pRemoteCharacteristic = nullptr;
+        if(!findCharacteristic() || !subscribe()) {
+            pClient->disconnect();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BLEMidiClientClass::findCharacteristic()
+{
+    MIDI_DEBUG_PRINTLN("pClient->getService()");
     BLERemoteService* pRemoteService = pClient->getService(MIDI_SERVICE_UUID.c_str());
     if(pRemoteService == nullptr) {
-        debug.println("Couldn't find remote service");
+        MIDI_DEBUG_PRINTLN("Couldn't find remote service");
         return false;
     }
-    debug.println("pRemoteService->getCharacteristic()");
+    MIDI_DEBUG_PRINTLN("pRemoteService->getCharacteristic()");
     pRemoteCharacteristic = pRemoteService->getCharacteristic(MIDI_CHARACTERISTIC_UUID.c_str());
     if(pRemoteCharacteristic == nullptr) {
-        debug.println("Couldn't find remote characteristic");
+        MIDI_DEBUG_PRINTLN("Couldn't find remote characteristic");
         return false;
     }
-    debug.println("Registering characteristic callback");
-    if(pRemoteCharacteristic->canNotify()) {
-        pRemoteCharacteristic->subscribe(true, [](BLERemoteCharacteristic* pBLERemoteCharacteristic, uint8_t* pData, size_t length, bool isNotify){
-            BLEMidiClient.receivePacket(pData, length); // We call the member function of the only instantiated class.
-            vTaskDelay(0);      // We leave some time for the IDLE task call esp_task_wdt_reset_watchdog
-                                // See comment from atanisoft here : https://github.com/espressif/arduino-esp32/issues/2493
-        });
+    attributesCached = true;
+    return true;
+}
+
+bool BLEMidiClientClass::subscribe()
+{
+    if(!pRemoteCharacteristic->canNotify())
+        return true;
+    return pRemoteCharacteristic->subscribe(true, onNotify);
+}
+
+void BLEMidiClientClass::onNotify(BLERemoteCharacteristic* pCharacteristic, uint8_t* pData, size_t length, bool isNotify)
+{
+    BLEMidiClient.handlePacket(pData, length); // We call the member function of the only instantiated class.
+}
+
+void BLEMidiClientClass::disconnect()
+{
+    linkState.store(LINK_IDLE);
+    // Ends the wait between two reconnection attempts
+    if(reconnectHandle != nullptr)
+        xTaskNotifyGive(reconnectHandle);
+    if(pClient != nullptr && pClient->isConnected())
+        pClient->disconnect();
+}
+
+bool BLEMidiClientClass::setAutoReconnect(bool enable, uint32_t maxDelayMs)
+{
+    reconnectMaxMs.store(max(maxDelayMs, (uint32_t)BLE_MIDI_RECONNECT_MIN_MS));
+    autoReconnect.store(enable);
+    if(reconnectHandle == nullptr && enable) {
+        TaskHandle_t task = nullptr;
+        if(xTaskCreatePinnedToCore(reconnectTask, "midiReconnect", BLE_MIDI_RECONNECT_TASK_STACK, this,
+                BLE_MIDI_RECONNECT_TASK_PRIORITY, &task, BLE_MIDI_RECONNECT_TASK_CORE) != pdPASS) {
+            autoReconnect.store(false);
+            return false;
+        }
+        reconnectHandle = task;
     }
-    connected=true;
+    // Picks up a link lost before, or ends the wait when disabled
+    if(reconnectHandle != nullptr)
+        xTaskNotifyGive(reconnectHandle);
     return true;
 }
 
+void BLEMidiClientClass::reconnectTask(void *parameter)
+{
+    static_cast<BLEMidiClientClass *>(parameter)->reconnectLoop();
+}
+
+// Woken by the loss of the link, tries at once, then waits between the attempts. disconnect()
+// and setAutoReconnect(false) wake a wait early, which ends the attempts.
+void BLEMidiClientClass::reconnectLoop()
+{
+    for(;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t delayMs = 0;
+        while(autoReconnect.load() && linkState.load() == LINK_LOST) {
+            if(scanning) {
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BLE_MIDI_RECONNECT_MIN_MS));
+                continue;
+            }
+            xSemaphoreTake(linkLock, portMAX_DELAY);
+            // connect() may have run in the meantime, to this device or another one
+            bool done = linkState.load() != LINK_LOST || connectLocked(peerAddress, "");
+            xSemaphoreGive(linkLock);
+            if(done)
+                break;
+            delayMs = delayMs == 0 ? BLE_MIDI_RECONNECT_MIN_MS : min(delayMs * 2, reconnectMaxMs.load());
+            MIDI_DEBUG_PRINTF("Reconnection failed, next attempt in %d ms\n", delayMs);
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(delayMs));
+        }
+    }
+}
+
+BLEMidiClientStats BLEMidiClientClass::getStats() const
+{
+    BLEMidiClientStats stats;
+    stats.connects = statConnects.load(std::memory_order_relaxed);
+    stats.failedConnects = statFailedConnects.load(std::memory_order_relaxed);
+    stats.disconnects = statDisconnects.load(std::memory_order_relaxed);
+    stats.reconnects = statReconnects.load(std::memory_order_relaxed);
+    stats.lastReconnectMs = statLastReconnectMs.load(std::memory_order_relaxed);
+    stats.maxReconnectMs = statMaxReconnectMs.load(std::memory_order_relaxed);
+    stats.firstConnectHeap = statFirstConnectHeap.load(std::memory_order_relaxed);
+    stats.freeHeap = statFreeHeap.load(std::memory_order_relaxed);
+    return stats;
+}
+
 void BLEMidiClientClass::setOnConnectCallback(void (*const onConnectCallback)())
 {
     this->onConnectCallback = onConnectCallback;
@@ -97,25 +372,17 @@ void BLEMidiClientClass::sendPacket(uint8_t *packet, uint8_t packetSize)
     pRemoteCharacteristic->writeValue(packet, packetSize, false);
 }
 
-ClientCallbacks::ClientCallbacks(
-    bool& connected,
-    void (*onConnectCallback)(), 
-    void (*onDisconnectCallback)()
-) :     connected(connected),
-        onConnectCallback(onConnectCallback),
-        onDisconnectCallback(onDisconnectCallback)
-{}
-
-void ClientCallbacks::onConnect(BLEClient *pClient)
-{
-    connected = true;
-    if(onConnectCallback != nullptr)
-        onConnectCallback();
-}
-
-void ClientCallbacks::onDisconnect(BLEClient *pClient)
+void BLEMidiClientClass::onDisconnect(BLEClient *pClient)
 {
     connected = false;
+    statDisconnects.fetch_add(1, std::memory_order_relaxed);
+    // Only a link that was up counts as lost; failed attempts and disconnect() do not
+    LinkState expected = LINK_CONNECTED;
+    if(linkState.compare_exchange_strong(expected, LINK_LOST)) {
+        lostMs.store(millis());
+        if(reconnectHandle != nullptr)
+            xTaskNotifyGive(reconnectHandle);
+    }
     if(onDisconnectCallback != nullptr)
         onDisconnectCallback();
 }
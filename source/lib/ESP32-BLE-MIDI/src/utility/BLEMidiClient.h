@@ -2,17 +2,58 @@
 #define BLE_MIDI_CLIENT_H
 
 #include <vector>
+#include <atomic>
 #include "BLEMidiBase.h"
+#include "BLEMidiDeviceRegistry.h"
 
-class BLEMidiClientClass : public BLEMidi {
+/// Automatic reconnection waits this long after a failed attempt, doubling up to the maximum
+#define BLE_MIDI_RECONNECT_MIN_MS 100
+#define BLE_MIDI_RECONNECT_MAX_MS 5000
+/// How long a connection attempt may take, in seconds
+#define BLE_MIDI_CONNECT_TIMEOUT 3
+/// Reconnection task, see BLEMidiClientClass::setAutoReconnect(); it runs the connection attempts
+#define BLE_MIDI_RECONNECT_TASK_PRIORITY 1
+#define BLE_MIDI_RECONNECT_TASK_CORE 1
+#define BLE_MIDI_RECONNECT_TASK_STACK 4096
+
+struct BLEMidiClientStats {
+    uint32_t connects;          // Successful connections, reconnections included
+    uint32_t failedConnects;    // Attempts that did not end with a usable link
+    uint32_t disconnects;       // Links lost or closed
+    uint32_t reconnects;        // Connections to the same device after the link was lost
+    uint32_t lastReconnectMs;   // From the link being lost to it being usable again
+    uint32_t maxReconnectMs;
+    uint32_t firstConnectHeap;  // Free heap after the first connection; compare freeHeap to see a leak
+    uint32_t freeHeap;          // Free heap after the latest connection attempt
+};
+
+class BLEMidiClientClass : public BLEMidi, public BLEClientCallbacks, public BLEAdvertisedDeviceCallbacks {
 public:
 
     /// Initializes the BLEMidiClient
     void begin(const std::string deviceName) override;
 
-    /// Begins a scan, and returns the number of MIDI devices found.
+    /// Begins a scan, and returns the number of MIDI devices found once it is over.
+    /// Blocks the calling task, which sleeps until the scan ends, for about 3 seconds.
     int scan();
 
+    /**
+     * Starts a scan in the background and returns at once. The scan ends after 'seconds', or,
+     * with stopOnMatch, at the first MIDI device that is known (connected to before, or bonded)
+     * or has the name given to setScanFilter(), when there is one.
+     * Found devices are available from getScannedDevice() once the scan is over.
+     * @return false if a scan is already running or could not be started
+     * */
+    bool startScan(uint32_t seconds = 3, bool stopOnMatch = true);
+    void stopScan();
+    bool isScanning();
+    /// Only MIDI devices with this name, and known ones, are reported. Empty to accept all.
+    void setScanFilter(const std::string name);
+    /// Called from the BLE host task for each MIDI device found; 'known' if connected to before or bonded
+    void setOnScanResult(void (*const onScanResultCallback)(BLEAdvertisedDevice *device, bool known));
+    /// Called from the BLE host task when a scan started by startScan() ends
+    void setOnScanComplete(void (*const onScanCompleteCallback)(int devicesFound));
+
     /// Returns the nth scanned MIDI device, or nullptr in case of an error. 
     /// Do not use the returned value if you perform another scan later, because it will be cleared.
     BLEAdvertisedDevice* getScannedDevice(uint32_t deviceIndex);
@@ -20,37 +61,98 @@ public:
     /// Connects to the nth scanned MIDI device
     bool connect(uint32_t deviceIndex = 0);
 
+    /// Connects to a device by address, without scanning
+    bool connect(const BLEAddress &address);
+
+    /// Tries the known devices, most recently connected first, without scanning
+    bool connectToKnownDevice();
+
+    /// Devices connected to before, most recent first; kept in NVS across reboots
+    int getKnownDeviceCount();
+    /// Returns the nth known device, or nullptr
+    const BLEMidiKnownDevice* getKnownDevice(uint32_t deviceIndex);
+    bool forgetDevice(const BLEAddress &address);
+    void forgetAllDevices();
+
+    /// Closes the link, without reconnecting automatically
+    void disconnect();
+
+    /**
+     * When the link is lost, a task started on the first call connects to the same device
+     * again: at once, then after BLE_MIDI_RECONNECT_MIN_MS, doubling the wait after each
+     * failure up to maxDelayMs. The attempts, up to BLE_MIDI_CONNECT_TIMEOUT seconds each,
+     * block that task only; connect() calls from other tasks wait for the attempt under way.
+     * @return false if the task could not be created
+     * */
+    bool setAutoReconnect(bool enable, uint32_t maxDelayMs = BLE_MIDI_RECONNECT_MAX_MS);
+    /// May be called from any task
+    BLEMidiClientStats getStats() const;
+
+    /// Called on the task that connected (the reconnection task for a reconnection), once the link can carry MIDI
     void setOnConnectCallback(void (*const onConnectCallback)());
+    /// Called from the BLE host task when the link is lost
     void setOnDisconnectCallback(void (*const onDisconnectCallback)());
 
 
 private:
+    enum LinkState : uint8_t {
+        LINK_IDLE,          // Not connected, nothing to reconnect to
+        LINK_CONNECTED,
+        LINK_LOST           // Not connected, the reconnection task reconnects to the last device
+    };
+
     /// This method is called by the base Midi class to send packets.
     virtual void sendPacket(uint8_t *packet, uint8_t packetSize) override;
 
+    bool connectTo(const BLEAddress &address, const std::string &name);
+    bool connectLocked(const BLEAddress &address, const std::string &name);
+    bool openLink(const BLEAddress &address);
+    bool findCharacteristic();
+    bool subscribe();
+    void onDisconnect(BLEClient *pClient) override;
+    void onResult(BLEAdvertisedDevice *device) override;
+    static void onScanComplete(BLEScanResults results);
+    static void onNotify(BLERemoteCharacteristic *pCharacteristic, uint8_t *pData, size_t length, bool isNotify);
+    void finishScan();
+    static void reconnectTask(void *parameter);
+    void reconnectLoop();
+
     BLEScan *pBLEScan = nullptr;
     std::vector<BLEAdvertisedDevice> foundMidiDevices;
-    BLERemoteCharacteristic* pRemoteCharacteristic;
+    BLEMidiDeviceRegistry registry;
+    std::string scanFilter;
+    bool stopOnMatch = false;
+    volatile bool scanning = false;
+    SemaphoreHandle_t scanDone = nullptr;   // Given when a scan ends, for scan() to wait on
+    void (*onScanResultCallback)(BLEAdvertisedDevice*, bool) = nullptr;
+    void (*onScanCompleteCallback)(int) = nullptr;
     void (*onConnectCallback)() = nullptr;
     void (*onDisconnectCallback)() = nullptr;
 
-};
+    // One client for every connection; its remote attributes stay valid while the peer is the same
+    BLEClient *pClient = nullptr;
+    BLERemoteCharacteristic* pRemoteCharacteristic = nullptr;
+    BLEAddress peerAddress;
+    bool attributesCached = false;
 
-/// Callbacks for connections and disconnections
-class ClientCallbacks : public BLEClientCallbacks {
-public:
-    ClientCallbacks(
-            bool& connected,
-            void (* const onConnectCallback)() = nullptr, 
-            void (* const onDisconnectCallback)() = nullptr
-    );
-private:
-    void onConnect(BLEClient*);
-    void onDisconnect(BLEClient*);
+    // Connection attempts hold it, so that the reconnection task and connect() take turns
+    SemaphoreHandle_t linkLock = nullptr;
+    TaskHandle_t reconnectHandle = nullptr;
+    // Written by the BLE host task on disconnection as well
+    std::atomic<LinkState> linkState{LINK_IDLE};
+    std::atomic<uint32_t> lostMs{0};
+    std::atomic<bool> autoReconnect{false};
+    std::atomic<uint32_t> reconnectMaxMs{BLE_MIDI_RECONNECT_MAX_MS};
 
-    bool& connected;
-    void (* const onConnectCallback)();
-    void (* const onDisconnectCallback)();
+    // Read by getStats() from any task; only disconnects is written outside linkLock
+    std::atomic<uint32_t> statConnects{0};
+    std::atomic<uint32_t> statFailedConnects{0};
+    std::atomic<uint32_t> statDisconnects{0};
+    std::atomic<uint32_t> statReconnects{0};
+    std::atomic<uint32_t> statLastReconnectMs{0};
+    std::atomic<uint32_t> statMaxReconnectMs{0};
+    std::atomic<uint32_t> statFirstConnectHeap{0};
+    std::atomic<uint32_t> statFreeHeap{0};
 };
 
 extern BLEMidiClientClass BLEMidiClient;
@@ -0,0 +1,97 @@
+#include <Preferences.h>
+#include <string.h>
+#include "BLEMidiDeviceRegistry.h"
+
+void BLEMidiDeviceRegistry::load()
+{
+    deviceCount = 0;
+    Preferences preferences;
+    if(!preferences.begin(BLE_MIDI_REGISTRY_NAMESPACE, true))
+        return;
+    size_t length = preferences.getBytesLength(BLE_MIDI_REGISTRY_KEY);
+    // A blob of another size was written by a different layout: start over
+    if(length > 0 && length <= sizeof(devices) && length % sizeof(BLEMidiKnownDevice) == 0
+            && preferences.getBytes(BLE_MIDI_REGISTRY_KEY, devices, length) == length) {
+        deviceCount = length / sizeof(BLEMidiKnownDevice);
+        for(uint8_t i = 0; i < deviceCount; i++)
+            devices[i].name[BLE_MIDI_KNOWN_NAME_LENGTH - 1] = '\0';
+    }
+    preferences.end();
+}
+
+void BLEMidiDeviceRegistry::remember(const BLEAddress &address, const std::string &name)
+{
+    int index = find(address);
+    if(index == 0 && (name.empty() || name == devices[0].name))
+        return;
+
+    BLEMidiKnownDevice device;
+    if(index >= 0)
+        device = devices[index];
+    else {
+        memcpy(device.address, address.getNative(), sizeof(device.address));
+        device.addressType = address.getType();
+        device.name[0] = '\0';
+        index = deviceCount < BLE_MIDI_KNOWN_DEVICES ? deviceCount++ : deviceCount - 1;
+    }
+    if(!name.empty()) {
+        strncpy(device.name, name.c_str(), BLE_MIDI_KNOWN_NAME_LENGTH - 1);
+        device.name[BLE_MIDI_KNOWN_NAME_LENGTH - 1] = '\0';
+    }
+    memmove(&devices[1], &devices[0], index * sizeof(BLEMidiKnownDevice));
+    devices[0] = device;
+    save();
+}
+
+bool BLEMidiDeviceRegistry::forget(const BLEAddress &address)
+{
+    int index = find(address);
+    if(index < 0)
+        return false;
+    deviceCount--;
+    memmove(&devices[index], &devices[index + 1], (deviceCount - index) * sizeof(BLEMidiKnownDevice));
+    save();
+    return true;
+}
+
+void BLEMidiDeviceRegistry::clear()
+{
+    deviceCount = 0;
+    save();
+}
+
+int BLEMidiDeviceRegistry::find(const BLEAddress &address) const
+{
+    const uint8_t *native = address.getNative();
+    for(uint8_t i = 0; i < deviceCount; i++) {
+        if(memcmp(devices[i].address, native, sizeof(devices[i].address)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const BLEMidiKnownDevice *BLEMidiDeviceRegistry::get(size_t index) const
+{
+    if(index >= deviceCount)
+        return nullptr;
+    return &devices[index];
+}
+
+BLEAddress BLEMidiDeviceRegistry::addressOf(const BLEMidiKnownDevice &device)
+{
+    uint8_t native[6];  // Older NimBLE versions take a non-const array
+    memcpy(native, device.address, sizeof(native));
+    return BLEAddress(native, device.addressType);
+}
+
+void BLEMidiDeviceRegistry::save()
+{
+    Preferences preferences;
+    if(!preferences.begin(BLE_MIDI_REGISTRY_NAMESPACE, false))
+        return;
+    if(deviceCount == 0)
+        preferences.remove(BLE_MIDI_REGISTRY_KEY);
+    else
+        preferences.putBytes(BLE_MIDI_REGISTRY_KEY, devices, deviceCount * sizeof(BLEMidiKnownDevice));
+    preferences.end();
+}
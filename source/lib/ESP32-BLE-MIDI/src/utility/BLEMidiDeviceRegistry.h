@@ -0,0 +1,52 @@
+#ifndef BLE_MIDI_DEVICE_REGISTRY_H
+#define BLE_MIDI_DEVICE_REGISTRY_H
+
+#include <NimBLEDevice.h>
+
+/// Devices the registry remembers; connecting to another one forgets the least recent
+#define BLE_MIDI_KNOWN_DEVICES 8
+/// Stored name length, including the terminating zero
+#define BLE_MIDI_KNOWN_NAME_LENGTH 24
+/// NVS namespace and key the registry is kept under
+#define BLE_MIDI_REGISTRY_NAMESPACE "blemidi"
+#define BLE_MIDI_REGISTRY_KEY "known"
+
+struct BLEMidiKnownDevice {
+    uint8_t address[6];         // As NimBLEAddress::getNative() returns it
+    uint8_t addressType;
+    char name[BLE_MIDI_KNOWN_NAME_LENGTH];
+};
+
+/**
+ * MIDI devices the client has connected to, most recent first, kept in NVS so that a
+ * reconnection after a reboot goes straight to the address without scanning.
+ * NVS is only written when the list changes, not on every connection to the same device.
+ * */
+class BLEMidiDeviceRegistry {
+public:
+    /// Reads the list back from NVS; a missing or unreadable entry gives an empty list
+    void load();
+
+    /// Puts the device first, adding it (and dropping the oldest one if full) when it is new.
+    /// An empty name keeps the stored one.
+    void remember(const BLEAddress &address, const std::string &name);
+    /// Returns false if the device was not known
+    bool forget(const BLEAddress &address);
+    void clear();
+
+    /// Index of the device, or -1
+    int find(const BLEAddress &address) const;
+    size_t count() const { return deviceCount; }
+    /// Returns the nth device, most recent first, or nullptr
+    const BLEMidiKnownDevice *get(size_t index) const;
+
+    static BLEAddress addressOf(const BLEMidiKnownDevice &device);
+
+private:
+    void save();
+
+    BLEMidiKnownDevice devices[BLE_MIDI_KNOWN_DEVICES];
+    uint8_t deviceCount = 0;
+};
+
+#endif
@@ -3,7 +3,9 @@
 void BLEMidiServerClass::begin(const std::string deviceName)
 {
     BLEMidi::begin(deviceName);
-    BLEServer *pServer = BLEDevice::createServer();
+    if(preferredMtu != 0)
+        BLEDevice::setMTU(preferredMtu);
+    pServer = BLEDevice::createServer();
     pServer->setCallbacks(this);
     BLEService *pService = pServer->createService(BLEUUID(MIDI_SERVICE_UUID));
     pCharacteristic = pService->createCharacteristic(
@@ -13,7 +15,9 @@ void BLEMidiServerClass::begin(const std::string deviceName)
         NIMBLE_PROPERTY::NOTIFY |
         NIMBLE_PROPERTY::WRITE_NR
     );
-    pCharacteristic->setCallbacks(new CharacteristicCallback([this](uint8_t *data, uint8_t size) { this->receivePacket(data, size); }));
+    pCharacteristic->setCallbacks(new CharacteristicCallback(
+        [this](uint8_t *data, uint8_t size) { this->handlePacket(data, size); },
+        [this]() { this->countCongestion(); }));
     pService->start();
     BLEAdvertising *pAdvertising = pServer->getAdvertising();
     pAdvertising->addServiceUUID(pService->getUUID());
@@ -34,26 +38,125 @@ void BLEMidiServerClass::sendPacket(uint8_t *packet, uint8_t packetSize)
 {
     if(!connected)
         return;
-    pCharacteristic->setValue(packet, packetSize);
-    pCharacteristic->notify();
+    // Straight from the packet buffer, without going through the characteristic's value
+    pCharacteristic->notify(packet, packetSize);
 }
 
-void BLEMidiServerClass::onConnect(BLEServer* pServer)
+void BLEMidiServerClass::setConnectionPolicy(uint16_t minInterval, uint16_t maxInterval, uint16_t latency,
+                                             uint16_t timeout, uint16_t mtu)
 {
+    this->minInterval = minInterval;
+    this->maxInterval = maxInterval;
+    this->latency = latency;
+    this->timeout = timeout;
+    this->preferredMtu = mtu;
+}
+
+float BLEMidiServerClass::getConnectionIntervalMs()
+{
+    return connected ? connDesc.conn_itvl * 1.25f : 0.0f;
+}
+
+uint16_t BLEMidiServerClass::getConnectionLatency()
+{
+    return connected ? connDesc.conn_latency : 0;
+}
+
+uint16_t BLEMidiServerClass::getSupervisionTimeoutMs()
+{
+    return connected ? connDesc.supervision_timeout * 10 : 0;
+}
+
+uint16_t BLEMidiServerClass::getMTU()
+{
+    return connected ? mtu.load() : 0;
+}
+
+uint8_t BLEMidiServerClass::getConnectionRequests()
+{
+    return connRequests;
+}
+
+// Attempt n asks for the policy's interval times 2^n
+void BLEMidiServerClass::requestConnectionParams()
+{
+    uint16_t handle = connHandle.load();
+    if(handle == BLE_HS_CONN_HANDLE_NONE || maxInterval == 0)
+        return;
+    uint16_t scale = 1 << connRequests;
+    // Supervision timeout must exceed (1 + latency) * interval * 2
+    uint16_t minTimeout = (uint32_t)(1 + latency) * maxInterval * scale * 2 * 125 / 1000 + 1;
+    pServer->updateConnParams(handle, minInterval * scale, maxInterval * scale, latency, max(timeout, minTimeout));
+    connRequests++;
+    lastRequestMs = millis();
+    MIDI_DEBUG_PRINTF("Requested connection interval %d..%d x 1.25 ms\n", minInterval * scale, maxInterval * scale);
+}
+
+void BLEMidiServerClass::update()
+{
+    // A new connection is taken up here rather than in onConnect(), so the connection fields
+    // below belong to the task that calls update() alone
+    if(connectPending.exchange(false)) {
+        connDesc = {};
+        connRequests = 0;
+        lastRequestMs = 0;
+        requestConnectionParams();
+    }
+
+    uint16_t handle = connHandle.load();
+    if(handle != BLE_HS_CONN_HANDLE_NONE && ble_gap_conn_find(handle, &connDesc) == 0) {
+        // A longer interval than asked for means the central rejected or ignored the request.
+        // The retry asks for twice as long, which only helps while that is still shorter than
+        // the interval in use.
+        uint16_t scale = 1 << (connRequests > 0 ? connRequests - 1 : 0);
+        uint32_t retryMaxInterval = (uint32_t)maxInterval * scale * 2;
+        if(connDesc.conn_itvl > maxInterval * scale && retryMaxInterval < connDesc.conn_itvl &&
+           connRequests <= BLE_MIDI_CONN_RETRIES && millis() - lastRequestMs >= BLE_MIDI_CONN_RETRY_MS)
+            requestConnectionParams();
+    }
+
+    uint16_t negotiatedMtu = mtu.load();
+    if(negotiatedMtu != appliedMtu) {
+        appliedMtu = negotiatedMtu;
+        // Notifications carry at most MTU - 3 bytes
+        setMaxPacketSize(min(negotiatedMtu - 3, MIDI_MAX_PACKET_SIZE));
+        MIDI_DEBUG_PRINTF("MTU %d\n", negotiatedMtu);
+    }
+
+    Midi::update();
+}
+
+void BLEMidiServerClass::onConnect(BLEServer* pServer, ble_gap_conn_desc* desc)
+{
+    mtu.store(BLE_ATT_MTU_DFLT);
+    connHandle.store(desc->conn_handle);
+    connectPending.store(true);
     connected = true;
+    // The central usually starts the MTU exchange itself; this covers those that do not
+    if(preferredMtu != 0)
+        ble_gattc_exchange_mtu(desc->conn_handle, nullptr, nullptr);
     if(onConnectCallback != nullptr)
         onConnectCallback();
 }
 
+void BLEMidiServerClass::onMTUChange(uint16_t MTU, ble_gap_conn_desc* desc)
+{
+    mtu.store(MTU);
+}
+
 void BLEMidiServerClass::onDisconnect(BLEServer* pServer)
 {
     connected = false;
+    connHandle.store(BLE_HS_CONN_HANDLE_NONE);
+    mtu.store(BLE_ATT_MTU_DFLT);
     if(onDisconnectCallback != nullptr)
         onDisconnectCallback();
     pServer->startAdvertising();
 }
 
-CharacteristicCallback::CharacteristicCallback(std::function<void(uint8_t*, uint8_t)> onWriteCallback) : onWriteCallback(onWriteCallback) {}
+CharacteristicCallback::CharacteristicCallback(std::function<void(uint8_t*, uint8_t)> onWriteCallback,
+                                               std::function<void()> onNotifyFailedCallback) :
+    onWriteCallback(onWriteCallback), onNotifyFailedCallback(onNotifyFailedCallback) {}
 
 void CharacteristicCallback::onWrite(BLECharacteristic *pCharacteristic)
 {
@@ -61,10 +164,13 @@ void CharacteristicCallback::onWrite(BLECharacteristic *pCharacteristic)
 
     if (rxValue.length() > 0 && onWriteCallback != nullptr)
         onWriteCallback((uint8_t*)rxValue.c_str(), rxValue.length());
+}
 
-    vTaskDelay(0);      // We leave some time for the IDLE task call esp_task_wdt_reset_watchdog
-                        // See comment from atanisoft here : https://github.com/espressif/arduino-esp32/issues/2493
-
+void CharacteristicCallback::onStatus(BLECharacteristic *pCharacteristic, Status s, int code)
+{
+    // ERROR_GATT: the host had no buffer for the notification, it is lost
+    if(s == Status::ERROR_GATT && onNotifyFailedCallback != nullptr)
+        onNotifyFailedCallback();
 }
 
 BLEMidiServerClass BLEMidiServer;
\ No newline at end of file
@@ -1,8 +1,20 @@
 #ifndef BLE_MIDI_SERVER_H
 #define BLE_MIDI_SERVER_H
 
+#include <atomic>
 #include "BLEMidiBase.h"
 
+/// Default connection policy: 7.5 to 15 ms interval (in 1.25 ms units), no slave latency, 2 s supervision timeout
+#define BLE_MIDI_MIN_INTERVAL 6
+#define BLE_MIDI_MAX_INTERVAL 12
+#define BLE_MIDI_LATENCY 0
+#define BLE_MIDI_TIMEOUT 200
+/// ATT MTU asked for, so aggregated packets can grow beyond 20 bytes
+#define BLE_MIDI_PREFERRED_MTU 247
+/// Rejected requests are repeated with twice the interval, this many times
+#define BLE_MIDI_CONN_RETRIES 2
+#define BLE_MIDI_CONN_RETRY_MS 1000
+
 
 class BLEMidiServerClass : public BLEMidi, public BLEServerCallbacks {
 public:
@@ -10,26 +22,70 @@ public:
 
     void setOnConnectCallback(void (*const onConnectCallback)());
     void setOnDisconnectCallback(void (*const onDisconnectCallback)());
-    
-    
+
+    /**
+     * Connection parameters the server asks for after each connection. The central decides;
+     * if it keeps a longer interval, the request is repeated with both bounds doubled,
+     * BLE_MIDI_CONN_RETRIES times (phones often insist on 15 ms or more), as long as that is
+     * still shorter than the interval in use. The requests are sent from update(). Call before begin().
+     * @param minInterval, maxInterval Connection interval bounds in 1.25 ms units, 0 to keep the central's choice
+     * @param latency Connection events the peripheral may skip
+     * @param timeout Supervision timeout in 10 ms units
+     * @param mtu ATT MTU to exchange, 0 to leave it to the central
+     * */
+    void setConnectionPolicy(uint16_t minInterval, uint16_t maxInterval, uint16_t latency = BLE_MIDI_LATENCY,
+                             uint16_t timeout = BLE_MIDI_TIMEOUT, uint16_t mtu = BLE_MIDI_PREFERRED_MTU);
+
+    /// Negotiated values of the current connection, 0 when not connected
+    float getConnectionIntervalMs();
+    uint16_t getConnectionLatency();
+    uint16_t getSupervisionTimeoutMs();
+    uint16_t getMTU();
+    /// Connection parameter requests sent since the last connection
+    uint8_t getConnectionRequests();
+
+    /// Also checks the connection parameters, repeats rejected requests and sizes aggregated packets to the MTU
+    void update() override;
 
 private:
     virtual void sendPacket(uint8_t *packet, uint8_t packetSize) override;
-    void onConnect(BLEServer* pServer) override;
+    void onConnect(BLEServer* pServer, ble_gap_conn_desc* desc) override;
     void onDisconnect(BLEServer* pServer) override;
-    
+    void onMTUChange(uint16_t MTU, ble_gap_conn_desc* desc) override;
+    void requestConnectionParams();
+
     void (*onConnectCallback)() = nullptr;
     void (*onDisconnectCallback)() = nullptr;
     BLECharacteristic* pCharacteristic = nullptr;
+    BLEServer* pServer = nullptr;
+
+    uint16_t minInterval = BLE_MIDI_MIN_INTERVAL;
+    uint16_t maxInterval = BLE_MIDI_MAX_INTERVAL;
+    uint16_t latency = BLE_MIDI_LATENCY;
+    uint16_t timeout = BLE_MIDI_TIMEOUT;
+    uint16_t preferredMtu = BLE_MIDI_PREFERRED_MTU;
+
+    // Written by the NimBLE host task in the callbacks, read by update()
+    std::atomic<uint16_t> connHandle{BLE_HS_CONN_HANDLE_NONE};
+    std::atomic<uint16_t> mtu{0};
+    std::atomic<bool> connectPending{false};
+    // Only used by the task that calls update()
+    uint16_t appliedMtu = 0;
+    ble_gap_conn_desc connDesc = {};
+    uint8_t connRequests = 0;
+    uint32_t lastRequestMs = 0;
 };
 
 
 class CharacteristicCallback: public BLECharacteristicCallbacks {
 public:
-    CharacteristicCallback(std::function<void(uint8_t*, uint8_t)> onWriteCallback);
+    CharacteristicCallback(std::function<void(uint8_t*, uint8_t)> onWriteCallback,
+                           std::function<void()> onNotifyFailedCallback = nullptr);
 private:
     void onWrite(BLECharacteristic *pCharacteristic);
+    void onStatus(BLECharacteristic *pCharacteristic, Status s, int code) override;
     std::function<void(uint8_t*, uint8_t)> onWriteCallback = nullptr;
+    std::function<void()> onNotifyFailedCallback = nullptr;
 };
 
 
@@ -3,6 +3,22 @@
 
 #include <Arduino.h>
 
+/// 0 removes the library's debug output at compile time; enableDebugging() then prints nothing
+#ifndef MIDI_DEBUG
+#define MIDI_DEBUG 1
+#endif
+
+/// Debug output through the 'debug' object in scope, formatted only when it is enabled
+#if MIDI_DEBUG
+#define MIDI_DEBUG_PRINT(...) do { if(debug.isEnabled()) debug.print(__VA_ARGS__); } while(0)
+#define MIDI_DEBUG_PRINTLN(...) do { if(debug.isEnabled()) debug.println(__VA_ARGS__); } while(0)
+#define MIDI_DEBUG_PRINTF(...) do { if(debug.isEnabled()) debug.printf(__VA_ARGS__); } while(0)
+#else
+#define MIDI_DEBUG_PRINT(...) do {} while(0)
+#define MIDI_DEBUG_PRINTLN(...) do {} while(0)
+#define MIDI_DEBUG_PRINTF(...) do {} while(0)
+#endif
+
 class Debug : public Stream {
 public:
     virtual int available();
@@ -13,6 +29,7 @@ public:
     
     void enable(Stream& stream);
     void disable();
+    bool isEnabled() const { return stream != nullptr; }
 
 private:
     Stream *stream = nullptr;
@@ -1,3 +1,4 @@
+#include <new>
 #include "Midi.h"
 
 /*
@@ -127,129 +128,198 @@ void Midi::pitchBend(uint8_t channel, float semitones, float range)
 
 void Midi::receivePacket(uint8_t *data, uint8_t size)
 {
-    debug.print("Received data : ");
-    for(uint8_t i=0; i<size; i++)
-        debug.printf("%x ", data[i]);
-    debug.println();
-
-    if(size < 3) {
-        debug.println("Invalid packet (size < 3)");
-        return;
+#if MIDI_DEBUG
+    if(debug.isEnabled()) {
+        debug.print("Received data : ");
+        for(uint8_t i=0; i<size; i++)
+            debug.printf("%x ", data[i]);
+        debug.println();
     }
+#endif
+    parser.parse(data, size);
+}
 
-    if((!(data[0] & 0b10000000)) || (!(data[1] & 0b10000000))) {
-        debug.println("Invalid packet");
-        return;
-    }
+void Midi::dispatchMessage(void *context, const uint8_t *message, uint8_t size, uint16_t timestamp)
+{
+    static_cast<Midi *>(context)->dispatchMessage(message, size, timestamp);
+}
 
-    currentTimestamp = ((data[0] & 0b111111) << 7);
+void Midi::dispatchMessage(const uint8_t *message, uint8_t size, uint16_t timestamp)
+{
+    uint8_t channel = message[0] & 0x0F;
 
-    uint8_t *ptr = &data[1];
+    switch(message[0] >> 4) {
+        case 0x8:
+            if(noteOffCallback != nullptr)
+                noteOffCallback(channel, message[1], message[2], timestamp);
+            MIDI_DEBUG_PRINTF("Note off, channel %d, note %d, velocity %d\n", channel, message[1], message[2]);
+            break;
 
-    uint8_t runningStatus = 0;
+        case 0x9:
+            if(noteOnCallback != nullptr)
+                noteOnCallback(channel, message[1], message[2], timestamp);
+            MIDI_DEBUG_PRINTF("Note on, channel %d, note %d, velocity %d\n", channel, message[1], message[2]);
+            break;
 
-    while(ptr - data < size) {
-        if(ptr[0] & 0b10000000) {
-            currentTimestamp = (currentTimestamp & 0b1111110000000) | (ptr[0] & 0b1111111);
-            ptr++;
-        }
+        case 0xA:
+            if(afterTouchPolyCallback != nullptr)
+                afterTouchPolyCallback(channel, message[1], message[2], timestamp);
+            MIDI_DEBUG_PRINTF("Polyphonic after touch, channel %d, note %d, pressure %d\n", channel, message[1], message[2]);
+            break;
+
+        case 0xB:
+            if(controlChangeCallback != nullptr)
+                controlChangeCallback(channel, message[1], message[2], timestamp);
+            MIDI_DEBUG_PRINTF("Control Change, channel %d, controller %d, value %d\n", channel, message[1], message[2]);
+            break;
+
+        case 0xC:
+            if(programChangeCallback != nullptr)
+                programChangeCallback(channel, message[1], timestamp);
+            MIDI_DEBUG_PRINTF("Program Change, channel %d, program %d\n", channel, message[1]);
+            break;
 
-        if(ptr[0] & 0b10000000) {   // Full midi message
-            runningStatus = *ptr ;
-            ptr++;
+        case 0xD:
+            if(afterTouchCallback != nullptr)
+                afterTouchCallback(channel, message[1], timestamp);
+            MIDI_DEBUG_PRINTF("After touch, channel %d, pressure %d\n", channel, message[1]);
+            break;
+
+        case 0xE: {
+            if(pitchBendCallback != nullptr)
+                pitchBendCallback(channel, message[1], message[2], timestamp);
+            uint16_t integerPitchBend = (message[2] << 7) | message[1];
+            if(pitchBendCallback2 != nullptr)
+                pitchBendCallback2(channel, integerPitchBend, timestamp);
+            MIDI_DEBUG_PRINTF("Pitch bend, channel %d, lsb %d, msb %d, value %d\n", channel, message[1], message[2],
+                              integerPitchBend);
+            break;
         }
 
-        uint8_t command = runningStatus >> 4;
-        uint8_t channel = runningStatus & 0b1111;
-
-        switch(command) {
-            case 0:
-                debug.println("Invalid packet : a running status message must be preceded by a full midi message");
-                return;
-            case 0b1000: {    // Note off
-                uint8_t note = ptr[0];
-                uint8_t velocity = ptr[1];
-                ptr += 2;
-                if(noteOffCallback != nullptr)
-                    noteOffCallback(channel, note, velocity, currentTimestamp);
-                debug.printf("Note off, channel %d, note %d, velocity %d\n", channel, note, velocity);
-                break;
-            }
+        default:
+            MIDI_DEBUG_PRINTF("System message %x, no callback\n", message[0]);
+            break;
+    }
+}
 
-            case 0b1001: {   // Note on
-                uint8_t note = ptr[0];
-                uint8_t velocity = ptr[1];
-                ptr += 2;
-                if(noteOnCallback != nullptr)
-                    noteOnCallback(channel, note, velocity, currentTimestamp);
-                debug.printf("Note on, channel %d, note %d, velocity %d\n", channel, note, velocity);
-                break;
-            }
+void Midi::dispatchBatch(void *context, const MidiEvent *events, size_t count)
+{
+    Midi *midi = static_cast<Midi *>(context);
+    if(midi->batchCallback != nullptr)
+        midi->batchCallback(midi->batchContext, events, count);
+}
 
-            case 0b1010: {    // Polyphonic after touch
-                uint8_t note = ptr[0];
-                uint8_t pressure = ptr[1];
-                ptr += 2;
-                if(afterTouchPolyCallback != nullptr)
-                    afterTouchPolyCallback(channel, note, pressure, currentTimestamp);
-                debug.printf("Polyphonic after touch, channel %d, note %d, pressure %d\n", channel, note, pressure);
-                break;
-            }
+void Midi::collectSysEx(void *context, MidiParser::SysExPart part, const uint8_t *data, size_t size,
+                        uint16_t timestamp)
+{
+    static_cast<Midi *>(context)->collectSysEx(part, data, size, timestamp);
+}
 
-            case 0b1011: {    // Control Change
-                uint8_t controller = ptr[0];
-                uint8_t value = ptr[1];
-                ptr += 2;
-                if(controlChangeCallback != nullptr)
-                    controlChangeCallback(channel, controller, value, currentTimestamp);
-                debug.printf("Control Change, channel %d, controller %d, value %d\n", channel, controller, value);
-                
-                break;
-            }
+// Reassembles SysEx into the caller's buffer
+void Midi::collectSysEx(MidiParser::SysExPart part, const uint8_t *data, size_t size, uint16_t timestamp)
+{
+    if(rxSysEx == nullptr)
+        return;
 
-            case 0b1100: {    // Program Change
-                uint8_t program = ptr[0];
-                ptr++;
-                if(programChangeCallback != nullptr)
-                    programChangeCallback(channel, program, currentTimestamp);
-                debug.printf("Program Change, channel %d, program %d\n", channel, program);
-                break;
-            }
+    switch(part) {
+        case MidiParser::SYSEX_START:
+            rxSysExSize = 0;
+            rxSysExOverflow = false;
+            break;
 
-            case 0b1101: {    // After touch
-                uint8_t pressure = ptr[0];
-                ptr++;
-                if(afterTouchCallback != nullptr)
-                    afterTouchCallback(channel, pressure, currentTimestamp);
-                debug.printf("After touch, channel %d, pressure %d\n", channel, pressure);
+        case MidiParser::SYSEX_DATA:
+            if(rxSysExSize + size > rxSysExCapacity) {
+                rxSysExOverflow = true;
                 break;
             }
+            memcpy(rxSysEx + rxSysExSize, data, size);
+            rxSysExSize += size;
+            break;
 
-            case 0b1110: {    // Pitch bend
-                uint8_t lsb = ptr[0];
-                uint8_t msb = ptr[1];
-                ptr += 2;
-                if(pitchBendCallback != nullptr)
-                    pitchBendCallback(channel, lsb, msb, currentTimestamp);
-                debug.printf("Pitch bend, channel %d, lsb %d, msb %d\n", channel, lsb, msb);
-                uint16_t integerPitchBend = ((msb & 127) << 7) | (lsb & 127);
-                if(pitchBendCallback2 != nullptr)
-                    pitchBendCallback2(channel, integerPitchBend, currentTimestamp);
-                debug.printf("Integer value of pitch bend : %d\n", integerPitchBend);
+        case MidiParser::SYSEX_END:
+            if(rxSysExOverflow) {
+                MIDI_DEBUG_PRINTLN("SysEx dropped, longer than the buffer");
                 break;
             }
+            if(sysExCallback != nullptr)
+                sysExCallback(rxSysEx, rxSysExSize, timestamp);
+            break;
 
-            case 0b1111:
-                debug.println("System common message, not implemented yet");
-                return;
-                break;
+        case MidiParser::SYSEX_ABORT:
+            MIDI_DEBUG_PRINTLN("SysEx broken off");
+            break;
+    }
+}
 
-            default:
-                debug.println("Invalid packet");
-                return;
-                break;
+void Midi::handlePacket(uint8_t *packet, size_t packetSize)
+{
+    if(rxQueue == nullptr) {
+        receivePacket(packet, packetSize);
+        vTaskDelay(0);      // We leave some time for the IDLE task call esp_task_wdt_reset_watchdog
+                            // See comment from atanisoft here : https://github.com/espressif/arduino-esp32/issues/2493
+        return;
+    }
+    if(!rxQueue->push(packet, packetSize)) {
+        rxDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    rxReceived.fetch_add(1, std::memory_order_relaxed);
+    if(rxTask != nullptr)
+        xTaskNotifyGive(rxTask);
+}
 
-        }
+bool Midi::enableReceiveQueue()
+{
+    if(rxQueue == nullptr)
+        rxQueue = new (std::nothrow) MidiRxQueue();
+    return rxQueue != nullptr;
+}
+
+uint16_t Midi::processReceived()
+{
+    if(rxQueue == nullptr)
+        return 0;
+    uint16_t waiting = rxQueue->waiting();
+    if(waiting > rxHighWater)
+        rxHighWater = waiting;
+    uint16_t count = 0;
+    for(MidiRxPacket *packet = rxQueue->front(); packet != nullptr; packet = rxQueue->front()) {
+        receivePacket(packet->data, packet->size);
+        rxQueue->release();
+        count++;
+    }
+    return count;
+}
+
+bool Midi::startReceiveTask(UBaseType_t priority, BaseType_t core, uint32_t stackSize)
+{
+    if(rxTask != nullptr)
+        return true;
+    if(!enableReceiveQueue())
+        return false;
+    TaskHandle_t task = nullptr;
+    if(xTaskCreatePinnedToCore(receiveTask, "midiRx", stackSize, this, priority, &task, core) != pdPASS)
+        return false;
+    rxTask = task;
+    return true;
+}
+
+MidiRxStats Midi::getRxStats() const
+{
+    MidiRxStats stats;
+    stats.received = rxReceived.load(std::memory_order_relaxed);
+    stats.dropped = rxDropped.load(std::memory_order_relaxed);
+    stats.highWater = rxHighWater;
+    stats.malformed = parser.getMalformed();
+    return stats;
+}
+
+void Midi::receiveTask(void *parameter)
+{
+    Midi *midi = static_cast<Midi *>(parameter);
+    for(;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        midi->processReceived();
     }
 }
 
@@ -332,7 +402,7 @@ void Midi::sendMMC(mmc_t command)
         case MMC_RESET:
             break;
         default:
-            debug.print("Warning: Unsupported MMC command");
+            MIDI_DEBUG_PRINT("Warning: Unsupported MMC command");
             break;
     }
 
@@ -349,20 +419,286 @@ void Midi::sendMMC(mmc_t command)
 }
 
 
+bool Midi::sendSysEx(const uint8_t *data, size_t size)
+{
+    uint16_t t = (explicitTimestamp ? timestamp : millis()) & 0x1FFF;
+    if(txTask == nullptr) {
+        flushPacket();
+        sendSysExNow(data, size, t);
+        return true;
+    }
+
+    // The queue only holds a marker, the task reads the data from here
+    xSemaphoreTake(txSysExLock, portMAX_DELAY);
+    txSysEx = data;
+    txSysExSize = size;
+    uint8_t marker = 0xF0;
+    bool queued = txQueue.push(&marker, 1, t);
+    if(queued) {
+        txQueued.fetch_add(1, std::memory_order_relaxed);
+        // Pending like any message, so that flush() wakes the task even when the queue was idle
+        txPending.store(true);
+        flush();
+        xSemaphoreTake(txSysExDone, portMAX_DELAY);
+    }
+    txSysEx = nullptr;
+    xSemaphoreGive(txSysExLock);
+    return queued;
+}
+
+// Start packet: header, timestamp, 0xF0 and data; continuation packets: header and data; the
+// timestamp and 0xF7 close the last one
+void Midi::sendSysExNow(const uint8_t *data, size_t size, uint16_t t)
+{
+    uint8_t headerByte = (1 << 7) | ((t >> 7) & ((1 << 6) - 1));
+    uint8_t timestampByte = (1 << 7) | (t & ((1 << 7) - 1));
+    uint8_t limit = maxPacketSize.load(std::memory_order_relaxed);
+
+    txSize = 0;
+    txPacket[txSize++] = headerByte;
+    txPacket[txSize++] = timestampByte;
+    txPacket[txSize++] = 0xF0;
+    for(size_t i = 0; i < size; i++) {
+        if(txSize == limit) {
+            sendPacket(txPacket, txSize);
+            packetsSent++;
+            txSize = 0;
+            txPacket[txSize++] = headerByte;
+        }
+        txPacket[txSize++] = data[i] & 0x7F;
+    }
+    if(txSize + 2 > limit) {
+        sendPacket(txPacket, txSize);
+        packetsSent++;
+        txSize = 0;
+        txPacket[txSize++] = headerByte;
+    }
+    txPacket[txSize++] = timestampByte;
+    txPacket[txSize++] = 0xF7;
+    sendPacket(txPacket, txSize);
+    packetsSent++;
+    messagesSent++;
+    txSize = 0;
+    txRunningStatus = 0;
+}
+
 void Midi::sendMessage(uint8_t *message, uint8_t messageSize)
 {
-    uint8_t packet[messageSize+2];
+    sendMessage(message, messageSize, explicitTimestamp ? timestamp : millis());
+}
+
+void Midi::sendMessage(uint8_t *message, uint8_t messageSize, uint16_t t)
+{
+    t &= 0x1FFF;   // 13 bit timestamp
+
+    if(txTask != nullptr) {
+        if(!txQueue.push(message, messageSize, t))
+            return;
+        txQueued.fetch_add(1, std::memory_order_relaxed);
+        if(!txPending.exchange(true))
+            wakeTransmitTask();
+        return;
+    }
+
+    if(!aggregation) {
+        flushPacket();
+        sendMessageNow(message, messageSize, t);
+        return;
+    }
+    appendMessage(message, messageSize, t);
+}
+
+// Adds the message to the pending packet, which is sent first if the message cannot join it
+void Midi::appendMessage(const uint8_t *message, uint8_t messageSize, uint16_t t)
+{
+    if(message[0] >= 0xF0) {
+        flushPacket();
+        sendMessageNow(message, messageSize, t);
+        return;
+    }
 
-    auto t = millis();
     uint8_t headerByte = (1 << 7) | ((t >> 7) & ((1 << 6) - 1));
     uint8_t timestampByte = (1 << 7) | (t & ((1 << 7) - 1));
 
-    packet[0] = headerByte;
-    packet[1] = timestampByte;
-    for(int i = 0; i < messageSize; i++)
-        packet[i+2] = message[i];
-    sendPacket(packet, messageSize + 2);
+    // The header holds the high timestamp bits of the whole packet, so they must not change,
+    // and a smaller low part would be read as a wrap-around
+    bool running = txSize > 0 && message[0] == txRunningStatus;
+    bool sameTime = txSize > 0 && timestampByte == txTimestampByte;
+    int needed = messageSize - (running ? 1 : 0) + (running && sameTime ? 0 : 1);
+    if(txSize > 0 && (headerByte != txPacket[0] || timestampByte < txTimestampByte ||
+                      txSize + needed > maxPacketSize.load(std::memory_order_relaxed))) {
+        flushPacket();
+        running = false;
+        sameTime = false;
+    }
 
+    if(txSize == 0) {
+        txPacket[txSize++] = headerByte;
+        txFirstMessageMs = millis();
+    }
+    // Running status: the status byte can go, and the timestamp too if it did not change
+    if(!(running && sameTime))
+        txPacket[txSize++] = timestampByte;
+    for(int i = running ? 1 : 0; i < messageSize; i++)
+        txPacket[txSize++] = message[i];
+    txRunningStatus = message[0];
+    txTimestampByte = timestampByte;
+    messagesSent++;
+}
+
+// Sends the message in a packet of its own, built in txPacket, which must be empty
+void Midi::sendMessageNow(const uint8_t *message, uint8_t messageSize, uint16_t t)
+{
+    if(messageSize + 2 > MIDI_MAX_PACKET_SIZE)
+        return;
+
+    txPacket[0] = (1 << 7) | ((t >> 7) & ((1 << 6) - 1));
+    txPacket[1] = (1 << 7) | (t & ((1 << 7) - 1));
+    memcpy(&txPacket[2], message, messageSize);
+    sendPacket(txPacket, messageSize + 2);
+    messagesSent++;
+    packetsSent++;
+}
+
+void Midi::setTimestamp(uint32_t milliseconds)
+{
+    explicitTimestamp = true;
+    timestamp = milliseconds & 0x1FFF;
+}
+
+void Midi::clearTimestamp()
+{
+    explicitTimestamp = false;
+}
+
+// ###################################
+// Aggregation
+
+void Midi::setAggregation(bool enable, uint16_t maxDelayMs)
+{
+    flush();
+    aggregation = enable;
+    this->maxDelayMs = maxDelayMs;
+}
+
+void Midi::setMaxPacketSize(uint8_t size)
+{
+    // The transmit task applies the new size from its next message on
+    if(txTask == nullptr)
+        flushPacket();
+    maxPacketSize.store(constrain(size, MIDI_DEFAULT_PACKET_SIZE, MIDI_MAX_PACKET_SIZE));
+}
+
+void Midi::flush()
+{
+    if(txTask != nullptr) {
+        // Without messages the task has not taken up yet, nothing is waiting for a flush
+        if(!txPending.load())
+            return;
+        txFlushRequested.store(true);
+        wakeTransmitTask();
+        return;
+    }
+    flushPacket();
+}
+
+void Midi::flushPacket()
+{
+    if(txSize == 0)
+        return;
+    sendPacket(txPacket, txSize);
+    packetsSent++;
+    txSize = 0;
+    txRunningStatus = 0;
+}
+
+void Midi::update()
+{
+    if(txTask == nullptr && txSize > 0 && millis() - txFirstMessageMs >= maxDelayMs)
+        flushPacket();
+}
+
+// ###################################
+// Transmit task
+
+bool Midi::startTransmitTask(UBaseType_t priority, BaseType_t core)
+{
+    if(txTask != nullptr)
+        return true;
+    flushPacket();
+    txSysExLock = xSemaphoreCreateMutex();
+    txSysExDone = xSemaphoreCreateBinary();
+    if(txSysExLock == nullptr || txSysExDone == nullptr)
+        return false;
+    TaskHandle_t task = nullptr;
+    if(xTaskCreatePinnedToCore(transmitTask, "midiTx", MIDI_TX_TASK_STACK, this, priority, &task, core) != pdPASS)
+        return false;
+    txTask = task;
+    return true;
+}
+
+MidiTxStats Midi::getTxStats() const
+{
+    MidiTxStats stats;
+    stats.queued = txQueued.load(std::memory_order_relaxed);
+    stats.overflows = txQueue.getOverflows();
+    stats.congestion = txCongestion.load(std::memory_order_relaxed);
+    stats.highWater = txHighWater;
+    return stats;
+}
+
+void Midi::wakeTransmitTask()
+{
+    if(xPortInIsrContext()) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(txTask, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+    else
+        xTaskNotifyGive(txTask);
+}
+
+void Midi::transmitTask(void *parameter)
+{
+    static_cast<Midi *>(parameter)->transmitLoop();
+}
+
+// Woken by the first message of a burst or by flush(). In aggregating mode, packs everything
+// queued into as few packets as the size limit and the timestamps allow, otherwise sends one
+// packet per message
+void Midi::transmitLoop()
+{
+    uint8_t message[MIDI_TX_EVENT_BYTES];
+    uint8_t size;
+    uint16_t t;
+
+    for(;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if(aggregation && !txFlushRequested.load())
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(maxDelayMs));
+        txFlushRequested.store(false);
+        // Messages from here on wake the task again
+        txPending.store(false);
+
+        uint16_t waiting = txQueue.waiting();
+        if(waiting > txHighWater)
+            txHighWater = waiting;
+        while(txQueue.pop(message, size, t)) {
+            if(size == 1 && message[0] == 0xF0) {
+                flushPacket();
+                sendSysExNow(txSysEx, txSysExSize, t);
+                xSemaphoreGive(txSysExDone);
+                continue;
+            }
+            if(!aggregation) {
+                flushPacket();
+                sendMessageNow(message, size, t);
+                continue;
+            }
+            appendMessage(message, size, t);
+        }
+        flushPacket();
+    }
 }
 
 // ###################################
@@ -408,6 +744,25 @@ void Midi::setPitchBendCallback(void (*callback)(uint8_t, uint16_t, uint16_t))
     pitchBendCallback2 = callback;
 }
 
+void Midi::setSysExCallback(void (*callback)(const uint8_t *, size_t, uint16_t))
+{
+    sysExCallback = callback;
+}
+
+void Midi::setSysExBuffer(uint8_t *buffer, size_t size)
+{
+    rxSysExSize = 0;
+    rxSysExCapacity = size;
+    rxSysEx = buffer;
+}
+
+void Midi::setBatchCallback(void (*callback)(void *, const MidiEvent *, size_t), void *context)
+{
+    batchContext = context;
+    batchCallback = callback;
+    parser.setBatchHandler(callback != nullptr ? dispatchBatch : nullptr);
+}
+
 void Midi::enableDebugging(Stream& debugStream) {
     debug.enable(debugStream);
 }
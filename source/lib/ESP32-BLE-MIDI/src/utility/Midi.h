@@ -2,7 +2,38 @@
 #define MIDI_H
 
 #include <Arduino.h>
+#include <atomic>
 #include "Debug.h"
+#include "MidiTxQueue.h"
+#include "MidiRxQueue.h"
+#include "MidiParser.h"
+
+/// Largest BLE-MIDI packet the aggregating transmit mode builds (ATT MTU 247 minus the 3 byte ATT header)
+#define MIDI_MAX_PACKET_SIZE 244
+/// Default packet size limit, for the 23 byte ATT MTU every connection starts with
+#define MIDI_DEFAULT_PACKET_SIZE 20
+/// Transmit task defaults, see Midi::startTransmitTask(); core 0 is the one the BLE host runs on
+#define MIDI_TX_TASK_PRIORITY 2
+#define MIDI_TX_TASK_CORE 0
+#define MIDI_TX_TASK_STACK 3072
+/// Receive task defaults, see Midi::startReceiveTask(); the stack also runs the callbacks
+#define MIDI_RX_TASK_PRIORITY 1
+#define MIDI_RX_TASK_CORE 1
+#define MIDI_RX_TASK_STACK 4096
+
+struct MidiTxStats {
+    uint32_t queued;        // Messages taken by the transmit queue
+    uint32_t overflows;     // Messages dropped because the queue was full
+    uint32_t congestion;    // Notifications the BLE stack refused, usually for lack of buffers
+    uint16_t highWater;     // Most messages waiting at once
+};
+
+struct MidiRxStats {
+    uint32_t received;      // Packets taken by the receive queue
+    uint32_t dropped;       // Packets dropped because the queue was full or they were too long
+    uint16_t highWater;     // Most packets waiting at once
+    uint32_t malformed;     // Packets the parser gave up on
+};
 
 
 class Midi {
@@ -39,7 +70,81 @@ public:
     void mmcReset(void);
     void mmcFastForward(void);
     void mmcRewind(void);
-    
+
+    /**
+     * Sends a SysEx of any length, split over as many packets as it needs (BLE-MIDI
+     * continuation packets). With the transmit task, waits until the task has sent it, so
+     * 'data' may be reused on return; do not call from an interrupt handler then.
+     * @param data Bytes between 0xF0 and 0xF7, 7 bit each
+     * @return false if the transmit queue was full
+     * */
+    bool sendSysEx(const uint8_t *data, size_t size);
+
+    /**
+     * Stamps the messages sent from now on with 'milliseconds', on the millis() clock, instead of
+     * their send time; e.g. with when the sound they describe was captured, so the receiver can
+     * remove detection and transmission jitter. Only the low 13 bits go out, so the time must be
+     * recent.
+     * */
+    void setTimestamp(uint32_t milliseconds);
+    /// Goes back to stamping messages with their send time
+    void clearTimestamp();
+
+    /**
+     * In aggregating mode, messages are collected into one BLE-MIDI packet, with running status
+     * where consecutive messages share a status byte, instead of one packet per message.
+     * The packet goes out when the next message would not fit, when the high bits of the
+     * timestamp change, when maxDelayMs have passed since its first message (see update()),
+     * or on flush(). System messages (SysEx, MMC) are always sent on their own.
+     * Without the transmit task, not thread-safe: send from one task only.
+     * @param enable true to aggregate, false to send every message at once (the default)
+     * @param maxDelayMs Longest time a message may wait for others
+     * */
+    void setAggregation(bool enable, uint16_t maxDelayMs = 5);
+    /**
+     * @param size Largest packet to build, normally the ATT MTU minus 3, up to MIDI_MAX_PACKET_SIZE
+     * */
+    void setMaxPacketSize(uint8_t size);
+    uint8_t getMaxPacketSize() const { return maxPacketSize.load(); }
+    /// Sends the pending aggregated packet, if any
+    void flush();
+    /// Call regularly in aggregating mode: sends the pending packet once its deadline has passed
+    virtual void update();
+    /// Number of MIDI messages and of BLE packets sent so far
+    uint32_t getMessagesSent() const { return messagesSent; }
+    uint32_t getPacketsSent() const { return packetsSent; }
+
+    /**
+     * Starts a task that owns the link. From then on, sending a message only copies it into a
+     * lock-free queue, so any task or interrupt handler may send without waiting for the BLE
+     * stack, and the task sends whatever is queued. In aggregating mode it waits up to maxDelayMs
+     * after the first message, or until flush(), for more to come and packs them into shared
+     * packets; otherwise every message goes out in its own packet. update() is not needed, and
+     * flush() with nothing queued does not wake the task. Messages that find the queue full are dropped and counted.
+     * The explicit timestamp (setTimestamp()) is shared by all senders.
+     * @return false if the task could not be created
+     * */
+    bool startTransmitTask(UBaseType_t priority = MIDI_TX_TASK_PRIORITY, BaseType_t core = MIDI_TX_TASK_CORE);
+    MidiTxStats getTxStats() const;
+
+    /**
+     * From then on the BLE host task only copies received packets into a preallocated queue,
+     * and processReceived() parses them and runs the callbacks, so slow callbacks no longer
+     * hold up the BLE host (and with it our own notifications).
+     * @return false if there is not enough memory for the queue
+     * */
+    bool enableReceiveQueue();
+    /// Parses the queued packets and runs their callbacks. Returns the number of packets.
+    uint16_t processReceived();
+    /**
+     * Enables the receive queue and starts a task that calls processReceived() whenever
+     * packets arrive, for applications without a loop of their own to call it from.
+     * @return false if the queue or the task could not be created
+     * */
+    bool startReceiveTask(UBaseType_t priority = MIDI_RX_TASK_PRIORITY, BaseType_t core = MIDI_RX_TASK_CORE,
+                          uint32_t stackSize = MIDI_RX_TASK_STACK);
+    MidiRxStats getRxStats() const;
+
 
     void setNoteOnCallback(void (*callback)(uint8_t channel, uint8_t note, uint8_t velocity, uint16_t timestamp));
     void setNoteOffCallback(void (*callback)(uint8_t channel, uint8_t note, uint8_t velocity, uint16_t timestamp));
@@ -49,6 +154,23 @@ public:
     void setAfterTouchCallback(void (*callback)(uint8_t channel, uint8_t pressure, uint16_t timestamp));
     void setPitchBendCallback(void (*callback)(uint8_t channel, uint8_t lsb, uint8_t msb, uint16_t timestamp));
     void setPitchBendCallback(void (*callback)(uint8_t channel, uint16_t value, uint16_t timestamp));
+    /**
+     * Received SysEx is reassembled, over as many packets as it spans, into 'buffer' and passed
+     * to the callback without 0xF0 and 0xF7. Longer ones are dropped. The buffer belongs to the
+     * library until it is replaced; the data is only valid during the callback.
+     * */
+    void setSysExCallback(void (*callback)(const uint8_t *data, size_t size, uint16_t timestamp));
+    void setSysExBuffer(uint8_t *buffer, size_t size);
+    /**
+     * Passes the messages of each received packet to one call, in order, instead of the
+     * per-message callbacks above, for receivers that handle them together, e.g. under one
+     * lock. System messages are included; SysEx still goes to the SysEx callback, after the
+     * messages that came before it. Packets with more than MIDI_EVENT_BATCH_SIZE messages
+     * come in several calls. The events are only valid during the call.
+     * @param callback nullptr to go back to the per-message callbacks
+     * */
+    void setBatchCallback(void (*callback)(void *context, const MidiEvent *events, size_t count),
+                          void *context = nullptr);
 
     void enableDebugging(Stream& debugStream = Serial);
     void disableDebugging();
@@ -56,6 +178,10 @@ public:
 protected:
     virtual void sendPacket(uint8_t *packet, uint8_t packetSize) = 0;
     void receivePacket(uint8_t *packet, uint8_t packetSize);
+    /// For subclasses, from the BLE host task: queues the packet, or parses it at once without the queue
+    void handlePacket(uint8_t *packet, size_t packetSize);
+    /// For subclasses to report a packet the BLE stack did not take
+    void countCongestion() { txCongestion.fetch_add(1, std::memory_order_relaxed); }
     Debug debug;
 
 private:
@@ -75,7 +201,22 @@ private:
         //TODO: Write, Goto, Shuttle
     };
     void sendMessage(uint8_t *message, uint8_t messageSize);
+    void sendMessage(uint8_t *message, uint8_t messageSize, uint16_t timestamp);
+    void appendMessage(const uint8_t *message, uint8_t messageSize, uint16_t timestamp);
+    void sendMessageNow(const uint8_t *message, uint8_t messageSize, uint16_t timestamp);
+    void flushPacket();
+    void wakeTransmitTask();
+    static void transmitTask(void *parameter);
+    void transmitLoop();
+    static void receiveTask(void *parameter);
     void sendMMC(mmc_t command);
+    static void dispatchMessage(void *context, const uint8_t *message, uint8_t size, uint16_t timestamp);
+    static void collectSysEx(void *context, MidiParser::SysExPart part, const uint8_t *data, size_t size,
+                             uint16_t timestamp);
+    void collectSysEx(MidiParser::SysExPart part, const uint8_t *data, size_t size, uint16_t timestamp);
+    void sendSysExNow(const uint8_t *data, size_t size, uint16_t timestamp);
+    void dispatchMessage(const uint8_t *message, uint8_t size, uint16_t timestamp);
+    static void dispatchBatch(void *context, const MidiEvent *events, size_t count);
     void (*noteOnCallback)(uint8_t, uint8_t, uint8_t, uint16_t) = nullptr;
     void (*noteOffCallback)(uint8_t, uint8_t, uint8_t, uint16_t) = nullptr;
     void (*afterTouchPolyCallback)(uint8_t, uint8_t, uint8_t, uint16_t) = nullptr;
@@ -84,9 +225,51 @@ private:
     void (*afterTouchCallback)(uint8_t, uint8_t, uint16_t) = nullptr;
     void (*pitchBendCallback)(uint8_t, uint8_t, uint8_t, uint16_t) = nullptr;
     void (*pitchBendCallback2)(uint8_t, uint16_t, uint16_t) = nullptr;
+    void (*sysExCallback)(const uint8_t *, size_t, uint16_t) = nullptr;
+    void (*batchCallback)(void *, const MidiEvent *, size_t) = nullptr;
+    void *batchContext = nullptr;
+
+    MidiParser parser{dispatchMessage, collectSysEx, this};
+    uint8_t *rxSysEx = nullptr;
+    size_t rxSysExCapacity = 0;
+    size_t rxSysExSize = 0;
+    bool rxSysExOverflow = false;
+
+    bool explicitTimestamp = false;
+    uint16_t timestamp = 0;
+
+    bool aggregation = false;
+    uint16_t maxDelayMs = 5;
+    std::atomic<uint8_t> maxPacketSize{MIDI_DEFAULT_PACKET_SIZE};
+    uint8_t txPacket[MIDI_MAX_PACKET_SIZE];
+    uint8_t txSize = 0;
+    uint8_t txRunningStatus = 0;
+    uint8_t txTimestampByte = 0;
+    uint32_t txFirstMessageMs = 0;
+    uint32_t messagesSent = 0;
+    uint32_t packetsSent = 0;
+
+    // With the transmit task, the packet above belongs to it alone
+    TaskHandle_t txTask = nullptr;
+    MidiTxQueue txQueue;
+    std::atomic<bool> txPending{false};         // Set by the first message the task has not seen
+    std::atomic<bool> txFlushRequested{false};
+    std::atomic<uint32_t> txQueued{0};
+    std::atomic<uint32_t> txCongestion{0};
+    // One SysEx at a time is handed to the transmit task, see sendSysEx()
+    SemaphoreHandle_t txSysExLock = nullptr;
+    SemaphoreHandle_t txSysExDone = nullptr;
+    const uint8_t *txSysEx = nullptr;
+    size_t txSysExSize = 0;
+    uint16_t txHighWater = 0;
+
+    // Receive queue, filled by the BLE host task
+    MidiRxQueue *rxQueue = nullptr;
+    TaskHandle_t rxTask = nullptr;
+    std::atomic<uint32_t> rxReceived{0};
+    std::atomic<uint32_t> rxDropped{0};
+    uint16_t rxHighWater = 0;
 
-    uint16_t currentTimestamp = 0;
-    
 };
 
 #endif
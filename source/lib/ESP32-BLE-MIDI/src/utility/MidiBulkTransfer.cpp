@@ -0,0 +1,324 @@
+#include "MidiBulkTransfer.h"
+
+// 8 bit data in groups of 7 bytes, each group led by a byte holding their high bits
+static size_t pack(const uint8_t *data, size_t size, uint8_t *out)
+{
+    size_t length = 0;
+    for(size_t group = 0; group < size; group += 7) {
+        uint8_t &highBits = out[length++] = 0;
+        for(size_t i = group; i < group + 7 && i < size; i++) {
+            highBits |= (data[i] >> 7) << (i - group);
+            out[length++] = data[i] & 0x7F;
+        }
+    }
+    return length;
+}
+
+static size_t unpack(const uint8_t *data, size_t size, uint8_t *out)
+{
+    size_t length = 0;
+    for(size_t group = 0; group < size; group += 8) {
+        uint8_t highBits = data[group];
+        for(size_t i = group + 1; i < group + 8 && i < size; i++)
+            out[length++] = data[i] | (((highBits >> (i - group - 1)) & 1) << 7);
+    }
+    return length;
+}
+
+static uint8_t checksum(const uint8_t *data, size_t size)
+{
+    uint8_t sum = 0;
+    for(size_t i = 0; i < size; i++)
+        sum ^= data[i];
+    return sum & 0x7F;
+}
+
+// ###################################
+// Sending
+
+bool MidiBulkTransfer::send(uint8_t type, const uint8_t *data, size_t size)
+{
+    if(sendState != SEND_IDLE || size == 0 || size >= (1UL << 28))
+        return false;
+
+    // As much as fits in one packet of the current connection
+    int packedMax = midi.getMaxPacketSize() - MIDI_BULK_CHUNK_OVERHEAD;
+    uint16_t chunk = packedMax / 8 * 7;
+    if(chunk == 0 || (size + chunk - 1) / chunk > MIDI_BULK_MAX_CHUNKS)
+        return false;
+
+    sendId = (sendId + 1) & 0x7F;
+    sendType = type & 0x7F;
+    sendData = data;
+    sendSize = size;
+    chunkSize = chunk;
+    chunkCount = (size + chunk - 1) / chunk;
+    base = 0;
+    nextToSend = 0;
+    fastRetransmitted = false;
+    retries = 0;
+    startMs = millis();
+    progressMs = startMs;
+    sendState = SEND_STARTING;
+    sendStart();
+    return true;
+}
+
+void MidiBulkTransfer::cancel()
+{
+    if(sendState == SEND_IDLE)
+        return;
+    sendAbort(sendId, ABORT_CANCELLED);
+    finishSending(ABORT_CANCELLED);
+}
+
+void MidiBulkTransfer::sendStart()
+{
+    uint8_t start[] = {
+        MIDI_BULK_MANUFACTURER, MIDI_BULK_TAG, OP_START, sendId, sendType,
+        (uint8_t)((sendSize >> 21) & 0x7F), (uint8_t)((sendSize >> 14) & 0x7F),
+        (uint8_t)((sendSize >> 7) & 0x7F), (uint8_t)(sendSize & 0x7F),
+        (uint8_t)(chunkSize >> 7), (uint8_t)(chunkSize & 0x7F),
+        MIDI_BULK_WINDOW
+    };
+    midi.sendSysEx(start, sizeof(start));
+}
+
+void MidiBulkTransfer::sendChunk(uint16_t sequence)
+{
+    size_t offset = (size_t)sequence * chunkSize;
+    size_t size = sendSize - offset < chunkSize ? sendSize - offset : chunkSize;
+
+    message[0] = MIDI_BULK_MANUFACTURER;
+    message[1] = MIDI_BULK_TAG;
+    message[2] = OP_DATA;
+    message[3] = sendId;
+    message[4] = sequence >> 7;
+    message[5] = sequence & 0x7F;
+    size_t packed = pack(sendData + offset, size, &message[6]);
+    message[6 + packed] = checksum(&message[6], packed);
+    midi.sendSysEx(message, 7 + packed);
+    stats.chunksSent++;
+}
+
+void MidiBulkTransfer::sendAck(uint16_t next)
+{
+    uint8_t ack[] = {MIDI_BULK_MANUFACTURER, MIDI_BULK_TAG, OP_ACK, receiveId, (uint8_t)(next >> 7), (uint8_t)(next & 0x7F)};
+    midi.sendSysEx(ack, sizeof(ack));
+    lastAcked = next;
+}
+
+void MidiBulkTransfer::sendAbort(uint8_t id, AbortReason reason)
+{
+    uint8_t abort[] = {MIDI_BULK_MANUFACTURER, MIDI_BULK_TAG, OP_ABORT, id, reason};
+    midi.sendSysEx(abort, sizeof(abort));
+}
+
+void MidiBulkTransfer::finishSending(AbortReason reason)
+{
+    sendState = SEND_IDLE;
+    sendData = nullptr;
+    if(reason == ABORT_NONE) {
+        stats.lastTransferMs = millis() - startMs;
+        stats.lastTransferBytes = sendSize;
+    }
+    if(onSent != nullptr)
+        onSent(reason);
+}
+
+void MidiBulkTransfer::handleAck(uint8_t id, uint16_t next)
+{
+    if(sendState == SEND_IDLE || id != sendId || next > chunkCount)
+        return;
+
+    if(sendState == SEND_STARTING) {
+        sendState = SEND_DATA;
+        progressMs = millis();
+        retries = 0;
+    }
+    if(next > base) {
+        base = next;
+        if(nextToSend < base)
+            nextToSend = base;
+        fastRetransmitted = false;
+        retries = 0;
+        progressMs = millis();
+        if(base == chunkCount) {
+            finishSending(ABORT_NONE);
+            return;
+        }
+    }
+    // The receiver saw a gap: go back once instead of waiting for the timeout
+    else if(next == base && nextToSend > base && !fastRetransmitted) {
+        stats.retransmits += nextToSend - base;
+        nextToSend = base;
+        fastRetransmitted = true;
+    }
+    update();
+}
+
+void MidiBulkTransfer::update()
+{
+    uint32_t now = millis();
+
+    if(receiving && now - receiveMs >= (uint32_t)MIDI_BULK_TIMEOUT_MS * (MIDI_BULK_RETRIES + 1))
+        receiving = false;
+
+    if(sendState == SEND_IDLE)
+        return;
+
+    if(now - progressMs >= MIDI_BULK_TIMEOUT_MS) {
+        if(++retries > MIDI_BULK_RETRIES) {
+            sendAbort(sendId, ABORT_TIMEOUT);
+            finishSending(ABORT_TIMEOUT);
+            return;
+        }
+        progressMs = now;
+        if(sendState == SEND_STARTING) {
+            sendStart();
+            return;
+        }
+        // Go back N
+        stats.retransmits += nextToSend - base;
+        nextToSend = base;
+    }
+
+    if(sendState != SEND_DATA)
+        return;
+    while(nextToSend < chunkCount && nextToSend < base + MIDI_BULK_WINDOW)
+        sendChunk(nextToSend++);
+}
+
+// ###################################
+// Receiving
+
+void MidiBulkTransfer::setReceiveBuffer(uint8_t *buffer, size_t size)
+{
+    receiving = false;
+    receiveBuffer = buffer;
+    receiveCapacity = size;
+}
+
+void MidiBulkTransfer::setOnReceived(void (*callback)(uint8_t, const uint8_t *, size_t))
+{
+    onReceived = callback;
+}
+
+void MidiBulkTransfer::setOnSent(void (*callback)(AbortReason))
+{
+    onSent = callback;
+}
+
+bool MidiBulkTransfer::handleSysEx(const uint8_t *data, size_t size)
+{
+    if(size < 4 || data[0] != MIDI_BULK_MANUFACTURER || data[1] != MIDI_BULK_TAG)
+        return false;
+
+    switch(data[2]) {
+        case OP_START:
+            handleStart(data, size);
+            break;
+        case OP_DATA:
+            handleData(data, size);
+            break;
+        case OP_ACK:
+            if(size >= 6)
+                handleAck(data[3], (data[4] << 7) | data[5]);
+            break;
+        case OP_ABORT:
+            if(sendState != SEND_IDLE && data[3] == sendId)
+                finishSending(size >= 5 ? (AbortReason)data[4] : ABORT_CANCELLED);
+            else if(receiving && data[3] == receiveId)
+                receiving = false;
+            break;
+    }
+    return true;
+}
+
+void MidiBulkTransfer::handleStart(const uint8_t *data, size_t size)
+{
+    if(size < 12)
+        return;
+    uint8_t id = data[3];
+    size_t total = ((size_t)data[5] << 21) | ((size_t)data[6] << 14) | (data[7] << 7) | data[8];
+    uint16_t chunk = (data[9] << 7) | data[10];
+
+    // A repeated start, our ack was lost
+    if(receiving && id == receiveId) {
+        sendAck(0);
+        return;
+    }
+    if(receiving) {
+        sendAbort(id, ABORT_BUSY);
+        return;
+    }
+    if(receiveBuffer == nullptr || total > receiveCapacity || chunk == 0) {
+        sendAbort(id, ABORT_TOO_LARGE);
+        return;
+    }
+
+    receiving = true;
+    completed = false;
+    receiveId = id;
+    receiveType = data[4];
+    receiveSize = total;
+    receiveChunkSize = chunk;
+    receiveChunkCount = (total + chunk - 1) / chunk;
+    receiveWindow = data[11] > 0 ? data[11] : 1;
+    expected = 0;
+    duplicateAcked = false;
+    receiveMs = millis();
+    receiveStartMs = receiveMs;
+    sendAck(0);
+}
+
+void MidiBulkTransfer::handleData(const uint8_t *data, size_t size)
+{
+    if(size < 7)
+        return;
+    uint8_t id = data[3];
+    uint16_t sequence = (data[4] << 7) | data[5];
+
+    // Chunks repeated after our final ack was lost
+    if(!receiving) {
+        if(completed && id == receiveId)
+            sendAck(receiveChunkCount);
+        return;
+    }
+    if(id != receiveId)
+        return;
+    receiveMs = millis();
+
+    const uint8_t *packed = &data[6];
+    size_t packedLength = size - 7;
+    size_t offset = (size_t)sequence * receiveChunkSize;
+    size_t length = receiveSize - offset < receiveChunkSize ? receiveSize - offset : receiveChunkSize;
+    if(sequence != expected || checksum(packed, packedLength) != data[size - 1] ||
+       packedLength != packedSize(length)) {
+        stats.badChunks++;
+        // Tell the sender where we are, once until there is progress again
+        if(!duplicateAcked) {
+            duplicateAcked = true;
+            sendAck(expected);
+        }
+        return;
+    }
+
+    unpack(packed, packedLength, receiveBuffer + offset);
+    stats.chunksReceived++;
+    expected++;
+    duplicateAcked = false;
+
+    if(expected == receiveChunkCount) {
+        sendAck(expected);
+        receiving = false;
+        completed = true;
+        stats.lastTransferMs = millis() - receiveStartMs;
+        stats.lastTransferBytes = receiveSize;
+        if(onReceived != nullptr)
+            onReceived(receiveType, receiveBuffer, receiveSize);
+    }
+    // Half a window between acks keeps the sender going without an ack per chunk
+    else if(expected - lastAcked >= (receiveWindow + 1) / 2)
+        sendAck(expected);
+}
@@ -0,0 +1,137 @@
+#ifndef MIDI_BULK_TRANSFER_H
+#define MIDI_BULK_TRANSFER_H
+
+#include "Midi.h"
+
+/// Manufacturer ID for non-commercial use, and the tag that marks bulk transfer SysEx
+#define MIDI_BULK_MANUFACTURER 0x7D
+#define MIDI_BULK_TAG 0x42
+/// Chunks in flight before the sender waits for an acknowledge
+#define MIDI_BULK_WINDOW 8
+/// Without progress for this long, the sender repeats the unacknowledged chunks
+#define MIDI_BULK_TIMEOUT_MS 250
+#define MIDI_BULK_RETRIES 5
+/// Packet bytes around the packed data of a chunk: BLE-MIDI header, two timestamps, 0xF0,
+/// 7D 42 02 <id>, sequence, checksum and 0xF7
+#define MIDI_BULK_CHUNK_OVERHEAD 12
+/// SysEx buffer the receiving side needs for one chunk at the largest packet size
+#define MIDI_BULK_SYSEX_BUFFER (MIDI_MAX_PACKET_SIZE - 5)
+/// Sequence numbers are 14 bit
+#define MIDI_BULK_MAX_CHUNKS 16383
+
+/**
+ * Moves a block of data (a preset, a tuning table, a recording) over a BLE-MIDI link as SysEx,
+ * with the 8 bit data packed into 7 bit bytes, split into chunks that each fill one packet,
+ * and a sliding window of MIDI_BULK_WINDOW chunks: the receiver acknowledges cumulatively,
+ * the sender goes back to the first unacknowledged chunk on a timeout or a repeated
+ * acknowledge, and gives up after MIDI_BULK_RETRIES timeouts without progress.
+ *
+ * Messages, between 0xF0 and 0xF7, all starting with 7D 42 <op> <transfer id>:
+ *   01 start  type, size (4 x 7 bit), chunk size (2 x 7 bit), window
+ *   02 data   sequence (2 x 7 bit), packed data, checksum (XOR of the packed bytes)
+ *   03 ack    next expected sequence (2 x 7 bit); the answer to start is ack 0
+ *   04 abort  reason
+ *
+ * Feed received SysEx to handleSysEx() (from the Midi SysEx callback, with a buffer of at
+ * least MIDI_BULK_SYSEX_BUFFER bytes) and call update() regularly, from the same task.
+ * */
+class MidiBulkTransfer {
+public:
+    enum AbortReason : uint8_t {
+        ABORT_NONE = 0,
+        ABORT_TOO_LARGE = 1,    // Receiver has no buffer that big
+        ABORT_TIMEOUT = 2,      // No progress after MIDI_BULK_RETRIES
+        ABORT_CANCELLED = 3,
+        ABORT_BUSY = 4          // Receiver is in the middle of another transfer
+    };
+
+    struct Stats {
+        uint32_t chunksSent;
+        uint32_t retransmits;   // Chunks sent again
+        uint32_t chunksReceived;
+        uint32_t badChunks;     // Out of order, or with a wrong checksum or size
+        uint32_t lastTransferMs;
+        uint32_t lastTransferBytes;
+    };
+
+    explicit MidiBulkTransfer(Midi &midi) : midi(midi) {}
+
+    /**
+     * Starts sending 'size' bytes of 'data', which must stay valid until the transfer ends.
+     * @param type Application-defined, 0 to 127, passed to the receiver
+     * @return false if a transfer is already going on or the data is too large
+     * */
+    bool send(uint8_t type, const uint8_t *data, size_t size);
+    void cancel();
+    bool isSending() const { return sendState != SEND_IDLE; }
+
+    /// Where received transfers go; larger ones are refused
+    void setReceiveBuffer(uint8_t *buffer, size_t size);
+    /// Called when a transfer has arrived completely
+    void setOnReceived(void (*callback)(uint8_t type, const uint8_t *data, size_t size));
+    /// Called when a sent transfer has been acknowledged completely (ABORT_NONE), or has failed
+    void setOnSent(void (*callback)(AbortReason reason));
+
+    /// Handles a received SysEx (without 0xF0 and 0xF7). Returns false if it is not ours.
+    bool handleSysEx(const uint8_t *data, size_t size);
+    /// Sends the chunks the window allows and handles timeouts
+    void update();
+
+    const Stats &getStats() const { return stats; }
+
+    /// Bytes 'size' raw bytes take when packed into 7 bit
+    static size_t packedSize(size_t size) { return size + (size + 6) / 7; }
+
+private:
+    enum Op : uint8_t { OP_START = 1, OP_DATA = 2, OP_ACK = 3, OP_ABORT = 4 };
+    enum SendState : uint8_t { SEND_IDLE, SEND_STARTING, SEND_DATA };
+
+    void sendStart();
+    void sendChunk(uint16_t sequence);
+    void sendAck(uint16_t next);
+    void sendAbort(uint8_t id, AbortReason reason);
+    void finishSending(AbortReason reason);
+    void handleStart(const uint8_t *data, size_t size);
+    void handleData(const uint8_t *data, size_t size);
+    void handleAck(uint8_t id, uint16_t next);
+
+    Midi &midi;
+    Stats stats = {};
+    uint8_t message[MIDI_BULK_SYSEX_BUFFER];
+
+    // Sending side
+    SendState sendState = SEND_IDLE;
+    uint8_t sendId = 0;
+    uint8_t sendType = 0;
+    const uint8_t *sendData = nullptr;
+    size_t sendSize = 0;
+    uint16_t chunkSize = 0;
+    uint16_t chunkCount = 0;
+    uint16_t base = 0;              // First unacknowledged chunk
+    uint16_t nextToSend = 0;
+    bool fastRetransmitted = false; // Went back once for the current base already
+    uint8_t retries = 0;
+    uint32_t progressMs = 0;
+    uint32_t startMs = 0;
+    void (*onSent)(AbortReason) = nullptr;
+
+    // Receiving side
+    uint8_t *receiveBuffer = nullptr;
+    size_t receiveCapacity = 0;
+    bool receiving = false;
+    uint8_t receiveId = 0;
+    uint8_t receiveType = 0;
+    size_t receiveSize = 0;
+    uint16_t receiveChunkSize = 0;
+    uint16_t receiveChunkCount = 0;
+    uint8_t receiveWindow = 0;
+    uint16_t expected = 0;          // Next chunk to accept
+    uint16_t lastAcked = 0;
+    bool duplicateAcked = false;    // Acknowledged an out-of-order chunk since the last progress
+    bool completed = false;         // receiveId finished; lost final acks are repeated
+    uint32_t receiveMs = 0;         // Last chunk
+    uint32_t receiveStartMs = 0;
+    void (*onReceived)(uint8_t, const uint8_t *, size_t) = nullptr;
+};
+
+#endif
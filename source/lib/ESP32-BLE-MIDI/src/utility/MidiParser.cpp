@@ -0,0 +1,165 @@
+#include "MidiParser.h"
+
+// Channel messages, by the high nibble of the status byte (0x8 to 0xE)
+static const uint8_t channelLength[8] = {
+    3, 3, 3, 3, 2, 2, 3, 0
+};
+
+// System messages, by the low nibble (0xF0 to 0xFF): SysEx is variable, 0xF4, 0xF5, 0xF9 and
+// 0xFD are undefined and taken as single bytes
+static const uint8_t systemLength[16] = {
+    0, 2, 3, 2, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1
+};
+
+uint8_t MidiParser::messageLength(uint8_t status)
+{
+    if(status >= 0xF0)
+        return systemLength[status & 0x0F];
+    return channelLength[(status >> 4) & 0x07];
+}
+
+uint16_t MidiParser::parse(const uint8_t *packet, size_t size)
+{
+    if(batchHandler == nullptr)
+        return parsePacket<false>(packet, size);
+    uint16_t messages = parsePacket<true>(packet, size);
+    flushBatch();
+    return messages;
+}
+
+// A byte with the high bit set is a timestamp, unless it directly follows one: then it is a
+// status byte. Data bytes right after a timestamp continue the running status.
+template<bool Batch> uint16_t MidiParser::parsePacket(const uint8_t *packet, size_t size)
+{
+    // The header must have bit 7 set; bit 6 is reserved
+    if(size < 2 || !(packet[0] & 0x80)) {
+        malformed++;
+        return 0;
+    }
+
+    uint16_t timestampHigh = (packet[0] & 0x3F) << 7;
+    uint8_t timestampLow = 0;
+    bool haveTimestamp = false;
+    bool afterTimestamp = false;
+    uint8_t message[3];
+    uint8_t length = 0;         // Of the message being collected, 0 when there is none
+    uint8_t count = 0;
+    uint8_t runningStatus = 0;  // Running status does not carry over from the previous packet
+    uint16_t messages = 0;
+
+    for(size_t i = 1; i < size; i++) {
+        uint8_t byte = packet[i];
+
+        if(!(byte & 0x80)) {
+            afterTimestamp = false;
+            if(inSysex) {
+                // Pass the whole run of data bytes at once
+                size_t end = i + 1;
+                while(end < size && !(packet[end] & 0x80))
+                    end++;
+                sysEx(SYSEX_DATA, &packet[i], end - i, timestampHigh | timestampLow);
+                i = end - 1;
+                continue;
+            }
+            if(length == 0) {
+                if(runningStatus == 0 || !haveTimestamp) {
+                    malformed++;
+                    return messages;
+                }
+                message[0] = runningStatus;
+                length = messageLength(runningStatus);
+                count = 1;
+            }
+            message[count++] = byte;
+            if(count == length) {
+                emit<Batch>(message, length, timestampHigh | timestampLow);
+                messages++;
+                length = 0;
+            }
+            continue;
+        }
+
+        if(!afterTimestamp) {
+            uint8_t low = byte & 0x7F;
+            // The low part wrapped around since the previous message of the packet
+            if(haveTimestamp && low < timestampLow)
+                timestampHigh = (timestampHigh + 0x80) & 0x1F80;
+            timestampLow = low;
+            haveTimestamp = true;
+            afterTimestamp = true;
+            continue;
+        }
+        afterTimestamp = false;
+
+        // Real-time messages may come anywhere and leave everything else as it was
+        if(byte >= 0xF8) {
+            emit<Batch>(&packet[i], 1, timestampHigh | timestampLow);
+            messages++;
+            continue;
+        }
+
+        // Any other status ends a SysEx and an unfinished message
+        if(inSysex) {
+            inSysex = false;
+            sysEx(byte == 0xF7 ? SYSEX_END : SYSEX_ABORT, nullptr, 0, timestampHigh | timestampLow);
+        }
+        if(byte == 0xF7)
+            continue;
+        if(length != 0) {
+            malformed++;
+            return messages;
+        }
+        if(byte == 0xF0) {
+            inSysex = true;
+            runningStatus = 0;
+            length = 0;
+            sysEx(SYSEX_START, nullptr, 0, timestampHigh | timestampLow);
+            continue;
+        }
+
+        // System common messages cancel running status
+        runningStatus = byte < 0xF0 ? byte : 0;
+        message[0] = byte;
+        length = messageLength(byte);
+        count = 1;
+        if(count == length) {
+            emit<Batch>(message, length, timestampHigh | timestampLow);
+            messages++;
+            length = 0;
+        }
+    }
+
+    // A message cut off by the end of the packet
+    if(length != 0)
+        malformed++;
+    return messages;
+}
+
+void MidiParser::sysEx(SysExPart part, const uint8_t *data, size_t size, uint16_t timestamp)
+{
+    flushBatch();
+    if(sysExHandler != nullptr)
+        sysExHandler(context, part, data, size, timestamp);
+}
+
+void MidiParser::addEvent(const uint8_t *message, uint8_t size, uint16_t timestamp)
+{
+    MidiEvent &event = events[eventCount++];
+    event.timestamp = timestamp;
+    event.size = size;
+    for(uint8_t i = 0; i < size; i++)
+        event.message[i] = message[i];
+    if(eventCount == MIDI_EVENT_BATCH_SIZE)
+        flushBatch();
+}
+
+void MidiParser::flushBatch()
+{
+    if(eventCount == 0)
+        return;
+    uint8_t count = eventCount;
+    eventCount = 0;
+    if(batchHandler != nullptr)
+        batchHandler(context, events, count);
+}
@@ -0,0 +1,94 @@
+#ifndef MIDI_PARSER_H
+#define MIDI_PARSER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/// Messages a batch holds; a packet with more is passed on in several batches
+#define MIDI_EVENT_BATCH_SIZE 32
+
+/// A received channel, system common or real-time message, for batch handlers
+struct MidiEvent {
+    uint16_t timestamp;     // 13 bit BLE-MIDI timestamp
+    uint8_t size;           // 1 to 3
+    uint8_t message[3];     // Status byte first, also for messages sent with running status
+};
+
+/**
+ * BLE-MIDI packet parser. Message lengths come from a status byte lookup; running status,
+ * 13 bit timestamps (with the low part wrapping into the high one) and real-time messages in
+ * the middle of other messages are handled. SysEx is passed on in parts, as it may continue
+ * over several packets. Plain C++ without Arduino dependencies, so it can be tested on the host.
+ * */
+class MidiParser {
+public:
+    /**
+     * Receives each complete channel, system common or real-time message.
+     * @param message Status byte followed by its data bytes
+     * */
+    typedef void (*Handler)(void *context, const uint8_t *message, uint8_t size, uint16_t timestamp);
+
+    enum SysExPart {
+        SYSEX_START,    // 0xF0 seen, no data
+        SYSEX_DATA,     // Data bytes, without 0xF0 and 0xF7
+        SYSEX_END,      // 0xF7 seen, no data
+        SYSEX_ABORT     // Another status byte broke the SysEx off
+    };
+    /**
+     * Receives a SysEx in parts: a start, the data bytes in runs as they come in the packets,
+     * and an end or abort. Real-time messages in between still go to the Handler.
+     * */
+    typedef void (*SysExHandler)(void *context, SysExPart part, const uint8_t *data, size_t size, uint16_t timestamp);
+    /**
+     * Receives the messages of a packet together, in order, up to MIDI_EVENT_BATCH_SIZE at a
+     * time. Pending messages are passed on before any SysEx part, so the order across both
+     * handlers is kept. The events are only valid during the call.
+     * */
+    typedef void (*BatchHandler)(void *context, const MidiEvent *events, size_t count);
+
+    MidiParser(Handler handler, void *context) : handler(handler), context(context) {}
+    MidiParser(Handler handler, SysExHandler sysExHandler, void *context) :
+        handler(handler), sysExHandler(sysExHandler), context(context) {}
+
+    /// Without a SysEx handler, SysEx is skipped
+    void setSysExHandler(SysExHandler sysExHandler) { this->sysExHandler = sysExHandler; }
+    /// While set, messages go to the batch handler instead of the Handler; nullptr to go back
+    void setBatchHandler(BatchHandler batchHandler) { this->batchHandler = batchHandler; }
+
+    /// Parses one packet. Returns the number of messages passed to the handler (or batch handler).
+    uint16_t parse(const uint8_t *packet, size_t size);
+
+    /// Packets that broke off at a malformed byte, and their messages up to there
+    uint32_t getMalformed() const { return malformed; }
+
+    /// Length of the message 'status' starts, status included; 0 for SysEx
+    static uint8_t messageLength(uint8_t status);
+
+private:
+    /// Batch chooses the sink once per packet, so the message loop does not test for it
+    template<bool Batch> uint16_t parsePacket(const uint8_t *packet, size_t size);
+    void sysEx(SysExPart part, const uint8_t *data, size_t size, uint16_t timestamp);
+    void flushBatch();
+
+    void addEvent(const uint8_t *message, uint8_t size, uint16_t timestamp);
+
+    /// Passes a message to the Handler, or adds it to the batch
+    template<bool Batch> void emit(const uint8_t *message, uint8_t size, uint16_t timestamp)
+    {
+        if(Batch)
+            addEvent(message, size, timestamp);
+        else
+            handler(context, message, size, timestamp);
+    }
+
+    Handler handler;
+    SysExHandler sysExHandler = nullptr;
+    BatchHandler batchHandler = nullptr;
+    void *context;
+    bool inSysex = false;       // SysEx may run on into the next packet
+    uint32_t malformed = 0;
+    MidiEvent events[MIDI_EVENT_BATCH_SIZE];
+    uint8_t eventCount = 0;
+};
+
+#endif
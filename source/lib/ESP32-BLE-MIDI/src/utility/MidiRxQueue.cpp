@@ -0,0 +1,31 @@
+#include "MidiRxQueue.h"
+
+bool MidiRxQueue::push(const uint8_t *data, size_t size)
+{
+    uint32_t position = head.load(std::memory_order_relaxed);
+    if(size > MIDI_RX_PACKET_BYTES || position - tail.load(std::memory_order_acquire) >= MIDI_RX_QUEUE_SIZE)
+        return false;
+    MidiRxPacket &packet = ring[position & (MIDI_RX_QUEUE_SIZE - 1)];
+    packet.size = size;
+    memcpy(packet.data, data, size);
+    head.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+MidiRxPacket *MidiRxQueue::front()
+{
+    uint32_t position = tail.load(std::memory_order_relaxed);
+    if(position == head.load(std::memory_order_acquire))
+        return nullptr;
+    return &ring[position & (MIDI_RX_QUEUE_SIZE - 1)];
+}
+
+void MidiRxQueue::release()
+{
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+uint16_t MidiRxQueue::waiting() const
+{
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+}
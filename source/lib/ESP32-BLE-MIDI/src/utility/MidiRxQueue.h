@@ -0,0 +1,39 @@
+#ifndef MIDI_RX_QUEUE_H
+#define MIDI_RX_QUEUE_H
+
+#include <Arduino.h>
+#include <atomic>
+
+/// Packets the receive queue holds, must be a power of two
+#define MIDI_RX_QUEUE_SIZE 8
+/// Largest packet it takes (ATT MTU 247 minus the 3 byte ATT header)
+#define MIDI_RX_PACKET_BYTES 244
+
+
+struct MidiRxPacket {
+    uint8_t size;
+    uint8_t data[MIDI_RX_PACKET_BYTES];
+};
+
+/**
+ * Fixed-capacity queue of received BLE-MIDI packets between the BLE host task, the only
+ * producer, and the task that parses them, the only consumer. Neither side blocks or allocates:
+ * a packet that finds the queue full, or is too long, is dropped.
+ * */
+class MidiRxQueue {
+public:
+    /// Copies the packet into the queue. Returns false when it was dropped.
+    bool push(const uint8_t *data, size_t size);
+    /// Oldest packet, or nullptr when there is none. It stays valid until release().
+    MidiRxPacket *front();
+    void release();
+    /// Packets pushed and not released yet
+    uint16_t waiting() const;
+
+private:
+    MidiRxPacket ring[MIDI_RX_QUEUE_SIZE];
+    std::atomic<uint32_t> head{0};      // Next slot to write, advanced by the producer
+    std::atomic<uint32_t> tail{0};      // Next slot to read, advanced by the consumer
+};
+
+#endif
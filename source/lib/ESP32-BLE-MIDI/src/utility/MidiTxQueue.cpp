@@ -0,0 +1,58 @@
+#include "MidiTxQueue.h"
+
+MidiTxQueue::MidiTxQueue()
+{
+    for(uint32_t i = 0; i < MIDI_TX_QUEUE_SIZE; i++)
+        ring[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+// Bounded multi-producer queue after D. Vyukov: a slot is free for position p when its
+// sequence equals p, and holds an event once it is p + 1
+bool MidiTxQueue::push(const uint8_t *message, uint8_t size, uint16_t timestamp)
+{
+    if(size > MIDI_TX_EVENT_BYTES)
+        return false;
+
+    uint32_t position = enqueuePosition.load(std::memory_order_relaxed);
+    MidiTxEvent *event;
+    for(;;) {
+        event = &ring[position & (MIDI_TX_QUEUE_SIZE - 1)];
+        int32_t difference = (int32_t)(event->sequence.load(std::memory_order_acquire) - position);
+        if(difference == 0) {
+            if(enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if(difference < 0) {
+            overflows.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else {
+            position = enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    event->timestamp = timestamp;
+    event->size = size;
+    memcpy(event->message, message, size);
+    event->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+bool MidiTxQueue::pop(uint8_t *message, uint8_t &size, uint16_t &timestamp)
+{
+    MidiTxEvent &event = ring[dequeuePosition & (MIDI_TX_QUEUE_SIZE - 1)];
+    if(event.sequence.load(std::memory_order_acquire) != dequeuePosition + 1)
+        return false;
+    timestamp = event.timestamp;
+    size = event.size;
+    memcpy(message, event.message, size);
+    // Hand the slot back for the producers' next lap
+    event.sequence.store(dequeuePosition + MIDI_TX_QUEUE_SIZE, std::memory_order_release);
+    dequeuePosition++;
+    return true;
+}
+
+uint16_t MidiTxQueue::waiting() const
+{
+    return enqueuePosition.load(std::memory_order_relaxed) - dequeuePosition;
+}
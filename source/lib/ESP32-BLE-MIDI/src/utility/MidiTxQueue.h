@@ -0,0 +1,43 @@
+#ifndef MIDI_TX_QUEUE_H
+#define MIDI_TX_QUEUE_H
+
+#include <Arduino.h>
+#include <atomic>
+
+/// Events the transmit queue holds, must be a power of two
+#define MIDI_TX_QUEUE_SIZE 64
+/// Longest message an event holds; MMC commands are 6 bytes
+#define MIDI_TX_EVENT_BYTES 8
+
+
+struct MidiTxEvent {
+    std::atomic<uint32_t> sequence;     // Slot turn, see MidiTxQueue::push()
+    uint16_t timestamp;                 // 13 bit BLE-MIDI timestamp
+    uint8_t size;
+    uint8_t message[MIDI_TX_EVENT_BYTES];
+};
+
+/**
+ * Fixed-capacity queue of MIDI messages waiting for the sender task. Any number of tasks, and
+ * interrupt handlers, may push; only the sender pops. Neither side blocks or allocates: a push
+ * into a full queue fails and is counted as an overflow.
+ * */
+class MidiTxQueue {
+public:
+    MidiTxQueue();
+    /// Copies the message into the queue. Returns false when it is full or the message too long.
+    bool push(const uint8_t *message, uint8_t size, uint16_t timestamp);
+    /// Single consumer: takes the oldest complete event. Returns false when there is none.
+    bool pop(uint8_t *message, uint8_t &size, uint16_t &timestamp);
+    /// Sender only: events pushed and not popped yet, including ones still being written
+    uint16_t waiting() const;
+    uint32_t getOverflows() const { return overflows.load(std::memory_order_relaxed); }
+
+private:
+    MidiTxEvent ring[MIDI_TX_QUEUE_SIZE];
+    std::atomic<uint32_t> enqueuePosition{0};
+    uint32_t dequeuePosition = 0;
+    std::atomic<uint32_t> overflows{0};
+};
+
+#endif
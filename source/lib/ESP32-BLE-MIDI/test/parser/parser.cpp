@@ -0,0 +1,339 @@
+// Round-trip, SysEx, batch, fuzz and speed test for the BLE-MIDI parser in MidiParser.cpp
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "MidiParser.h"
+
+#define ROUND_TRIP_PACKETS 200000
+#define FUZZ_PACKETS 2000000
+#define BENCH_SECONDS 2.0
+
+struct Message {
+    uint8_t bytes[3];
+    uint8_t size;
+    uint16_t timestamp;
+};
+
+static std::vector<Message> received;
+// SysEx data as sent and as parsed, each SysEx closed by 0xFF
+static std::vector<uint8_t> sentSysEx, receivedSysEx;
+
+void collect(void *context, const uint8_t *message, uint8_t size, uint16_t timestamp)
+{
+    Message m;
+    memcpy(m.bytes, message, size);
+    m.size = size;
+    m.timestamp = timestamp;
+    received.push_back(m);
+}
+
+void collectSysEx(void *context, MidiParser::SysExPart part, const uint8_t *data, size_t size, uint16_t timestamp)
+{
+    if(part == MidiParser::SYSEX_DATA)
+        receivedSysEx.insert(receivedSysEx.end(), data, data + size);
+    else if(part == MidiParser::SYSEX_END)
+        receivedSysEx.push_back(0xFF);
+}
+
+// Only checks what every message must satisfy, for random input
+void check(void *context, const uint8_t *message, uint8_t size, uint16_t timestamp)
+{
+    if(!(message[0] & 0x80) || message[0] == 0xF0 || message[0] == 0xF7 ||
+       size != MidiParser::messageLength(message[0]) || timestamp >= (1 << 13)) {
+        fprintf(stderr, "Test failed: bad message %02x, size %d\n", message[0], size);
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 1; i < size; i++)
+        if(message[i] & 0x80) {
+            fprintf(stderr, "Test failed: status byte in data\n");
+            exit(EXIT_FAILURE);
+        }
+    (*(uint32_t *)context)++;
+}
+
+void count(void *context, const uint8_t *message, uint8_t size, uint16_t timestamp)
+{
+    (*(uint32_t *)context)++;
+}
+
+void countBatch(void *context, const MidiEvent *events, size_t count)
+{
+    *(uint32_t *)context += count;
+}
+
+Message randomMessage()
+{
+    static const uint8_t system[] = {0xF1, 0xF2, 0xF3, 0xF6, 0xF8, 0xFA, 0xFB, 0xFC, 0xFE, 0xFF};
+    Message m;
+    if(rand() % 8 == 0)
+        m.bytes[0] = system[rand() % sizeof(system)];
+    else
+        m.bytes[0] = 0x80 | ((rand() % 7) << 4) | (rand() % 2);    // Two channels, for running status
+    m.size = MidiParser::messageLength(m.bytes[0]);
+    for(int i = 1; i < m.size; i++)
+        m.bytes[i] = rand() & 0x7F;
+    return m;
+}
+
+// Encodes 'messages' like a BLE-MIDI sender: running status where allowed, the timestamp byte
+// left out at random when it repeats, a SysEx now and then, and
+// clock messages in the middle of others. 'expected' gets the messages in the order they
+// must come out of the parser.
+std::vector<uint8_t> encode(const std::vector<Message> &messages, std::vector<Message> &expected)
+{
+    expected.clear();
+    std::vector<uint8_t> packet;
+    packet.push_back(0x80 | ((messages[0].timestamp >> 7) & 0x3F));
+    uint8_t runningStatus = 0;
+    int lastTimestamp = -1;
+    for(const Message &m : messages) {
+        if(rand() % 16 == 0) {
+            packet.push_back(0x80 | (m.timestamp & 0x7F));
+            packet.push_back(0xF0);
+            for(int i = rand() % 5; i > 0; i--) {
+                packet.push_back(rand() & 0x7F);
+                sentSysEx.push_back(packet.back());
+            }
+            packet.push_back(0x80 | (m.timestamp & 0x7F));
+            packet.push_back(0xF7);
+            sentSysEx.push_back(0xFF);
+            runningStatus = 0;
+        }
+        bool running = m.bytes[0] == runningStatus && m.bytes[0] < 0xF0;
+        if(!running || m.timestamp != lastTimestamp || rand() % 2)
+            packet.push_back(0x80 | (m.timestamp & 0x7F));
+        for(int i = running ? 1 : 0; i < m.size; i++) {
+            if(i > (running ? 1 : 0) && rand() % 32 == 0) {     // Not right after a timestamp
+                Message clock = {{0xF8}, 1, m.timestamp};
+                packet.push_back(0x80 | (m.timestamp & 0x7F));
+                packet.push_back(0xF8);
+                expected.push_back(clock);
+            }
+            packet.push_back(m.bytes[i]);
+        }
+        expected.push_back(m);
+        if(m.bytes[0] < 0xF8)
+            runningStatus = m.bytes[0] < 0xF0 ? m.bytes[0] : 0;
+        lastTimestamp = m.timestamp;
+    }
+    return packet;
+}
+
+void roundTrip()
+{
+    MidiParser parser(collect, collectSysEx, nullptr);
+    uint32_t messages = 0;
+    for(int p = 0; p < ROUND_TRIP_PACKETS; p++) {
+        // Timestamps rise by up to 40 ms per message, so the low part wraps within packets
+        std::vector<Message> sent;
+        uint16_t t = rand() & 0x1FFF;
+        for(int i = 1 + rand() % 30; i > 0; i--) {
+            Message m = randomMessage();
+            m.timestamp = t;
+            sent.push_back(m);
+            if(rand() % 2)
+                t = (t + rand() % 40) & 0x1FFF;
+        }
+        // The high part comes from the header only, so it may not move more than one wrap
+        while(sent.size() > 1 && ((sent.back().timestamp - sent[0].timestamp) & 0x1FFF) >= 128)
+            sent.pop_back();
+
+        std::vector<Message> expected;
+        std::vector<uint8_t> packet = encode(sent, expected);
+        received.clear();
+        parser.parse(packet.data(), packet.size());
+        if(received.size() != expected.size()) {
+            fprintf(stderr, "Test failed: packet %d, %zu messages sent, %zu parsed\n", p, expected.size(), received.size());
+            exit(EXIT_FAILURE);
+        }
+        for(size_t i = 0; i < expected.size(); i++) {
+            if(received[i].size != expected[i].size || received[i].timestamp != expected[i].timestamp ||
+               memcmp(received[i].bytes, expected[i].bytes, expected[i].size) != 0) {
+                fprintf(stderr, "Test failed: packet %d, message %zu differs\n", p, i);
+                exit(EXIT_FAILURE);
+            }
+        }
+        messages += expected.size();
+    }
+    if(parser.getMalformed() != 0) {
+        fprintf(stderr, "Test failed: %u valid packets taken as malformed\n", parser.getMalformed());
+        exit(EXIT_FAILURE);
+    }
+    if(receivedSysEx != sentSysEx) {
+        fprintf(stderr, "Test failed: SysEx data differs\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("round trip: %d packets, %u messages ok\n", ROUND_TRIP_PACKETS, messages);
+}
+
+// Long SysEx split over packets like Midi::sendSysEx() does, with clock messages in between
+void sysExContinuation()
+{
+    MidiParser parser(collect, collectSysEx, nullptr);
+    sentSysEx.clear();
+    receivedSysEx.clear();
+    for(int n = 0; n < 2000; n++) {
+        size_t limit = 20 + rand() % 225;
+        std::vector<uint8_t> packet = {0x80, 0x80, 0xF0};
+        for(int i = rand() % 2000; i > 0; i--) {
+            if(packet.size() + 3 > limit) {
+                parser.parse(packet.data(), packet.size());
+                packet = {0x80};
+            }
+            if(rand() % 64 == 0) {
+                packet.push_back(0x80);
+                packet.push_back(0xF8);
+            }
+            packet.push_back(rand() & 0x7F);
+            sentSysEx.push_back(packet.back());
+        }
+        if(packet.size() + 2 > limit) {
+            parser.parse(packet.data(), packet.size());
+            packet = {0x80};
+        }
+        packet.push_back(0x80);
+        packet.push_back(0xF7);
+        sentSysEx.push_back(0xFF);
+        parser.parse(packet.data(), packet.size());
+    }
+    if(receivedSysEx != sentSysEx || parser.getMalformed() != 0) {
+        fprintf(stderr, "Test failed: multi-packet SysEx differs\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("SysEx: 2000 multi-packet messages, %zu bytes ok\n", sentSysEx.size());
+}
+
+// Handler calls in order: 'b' for a batch, 's' for a SysEx part
+static std::vector<char> handlerCalls;
+static std::vector<size_t> batchSizes;
+
+void unexpected(void *context, const uint8_t *message, uint8_t size, uint16_t timestamp)
+{
+    fprintf(stderr, "Test failed: message handler called in batch mode\n");
+    exit(EXIT_FAILURE);
+}
+
+void collectBatch(void *context, const MidiEvent *events, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+        collect(context, events[i].message, events[i].size, events[i].timestamp);
+    batchSizes.push_back(count);
+    handlerCalls.push_back('b');
+}
+
+void recordSysEx(void *context, MidiParser::SysExPart part, const uint8_t *data, size_t size, uint16_t timestamp)
+{
+    handlerCalls.push_back('s');
+}
+
+// Same messages from the batch handler as from the message handler, in batches of at most
+// MIDI_EVENT_BATCH_SIZE, with pending ones passed on before each SysEx part
+void batches()
+{
+    // 80 control changes with running status and a clock among them, in one packet
+    std::vector<uint8_t> packet = {0x80, 0x81, 0xB0, 0x01, 0x00};
+    for(int i = 1; i < 80; i++) {
+        if(i == 40) {
+            packet.push_back(0x82);
+            packet.push_back(0xF8);
+        }
+        packet.push_back(0x01);
+        packet.push_back(i);
+    }
+    received.clear();
+    MidiParser reference(collect, nullptr);
+    reference.parse(packet.data(), packet.size());
+    std::vector<Message> expected = received;
+
+    received.clear();
+    MidiParser parser(unexpected, recordSysEx, nullptr);
+    parser.setBatchHandler(collectBatch);
+    uint16_t messages = parser.parse(packet.data(), packet.size());
+    bool same = received.size() == expected.size() && messages == expected.size();
+    for(size_t i = 0; same && i < expected.size(); i++)
+        same = received[i].size == expected[i].size && received[i].timestamp == expected[i].timestamp &&
+               memcmp(received[i].bytes, expected[i].bytes, expected[i].size) == 0;
+    if(!same || batchSizes != std::vector<size_t>{MIDI_EVENT_BATCH_SIZE, MIDI_EVENT_BATCH_SIZE, 17}) {
+        fprintf(stderr, "Test failed: 81 messages not split into batches of %d\n", MIDI_EVENT_BATCH_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    // Control change, SysEx, control change: the first one comes out before the SysEx starts
+    handlerCalls.clear();
+    packet = {0x80, 0x81, 0xB0, 0x07, 0x10, 0x81, 0xF0, 0x7D, 0x01, 0x82, 0xF7, 0x82, 0xB0, 0x07, 0x11};
+    parser.parse(packet.data(), packet.size());
+    if(handlerCalls != std::vector<char>{'b', 's', 's', 's', 'b'}) {
+        fprintf(stderr, "Test failed: batch not passed on before SysEx\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("batches: %zu batches, SysEx order ok\n", batchSizes.size() + 2);
+}
+
+void fuzz()
+{
+    uint32_t messages = 0;
+    MidiParser parser(check, &messages);
+    uint8_t packet[244];
+    for(int p = 0; p < FUZZ_PACKETS; p++) {
+        size_t size = rand() % sizeof(packet);
+        for(size_t i = 0; i < size; i++)
+            packet[i] = rand() % 4 ? (rand() | 0x80) : (rand() & 0x7F);     // Mostly status and timestamp bytes
+        parser.parse(packet, size);
+    }
+    printf("fuzz: %d random packets, %u messages, %u malformed\n", FUZZ_PACKETS, messages, parser.getMalformed());
+}
+
+void bench()
+{
+    // Typical traffic: 1 to 12 channel messages per packet
+    std::vector<std::vector<uint8_t>> packets;
+    for(int p = 0; p < 1024; p++) {
+        std::vector<Message> sent;
+        uint16_t t = rand() & 0x1FFF;
+        for(int i = 1 + rand() % 12; i > 0; i--) {
+            Message m;
+            do
+                m = randomMessage();
+            while(m.bytes[0] >= 0xF0);
+            m.timestamp = t;
+            sent.push_back(m);
+        }
+        std::vector<Message> expected;
+        packets.push_back(encode(sent, expected));
+    }
+
+    // Per message, then in batches
+    for(int batch = 0; batch < 2; batch++) {
+        uint32_t messages = 0;
+        MidiParser parser(count, &messages);
+        if(batch)
+            parser.setBatchHandler(countBatch);
+        uint64_t bytes = 0;
+        clock_t start = clock();
+        double seconds = 0.0;
+        while(seconds < BENCH_SECONDS) {
+            for(const std::vector<uint8_t> &packet : packets) {
+                parser.parse(packet.data(), packet.size());
+                bytes += packet.size();
+            }
+            seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        }
+        printf("bench%s: %.1f million messages/s, %.1f MB/s\n", batch ? " (batches)" : "", messages / seconds / 1e6,
+               bytes / seconds / 1e6);
+    }
+}
+
+int main(void)
+{
+    srand(1);
+    roundTrip();
+    sysExContinuation();
+    batches();
+    fuzz();
+    bench();
+    return 0;
+}
@@ -0,0 +1,180 @@
+// Just enough of Arduino-ESP32 and FreeRTOS to build the Midi class on the host: tasks are
+// threads, task notifications and semaphores are condition variables, ticks are milliseconds
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+#define lowByte(w) ((uint8_t)((w) & 0xFF))
+#define highByte(w) ((uint8_t)((w) >> 8))
+#define constrain(amount, low, high) ((amount) < (low) ? (low) : ((amount) > (high) ? (high) : (amount)))
+
+inline unsigned long millis()
+{
+    static const auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline void delay(unsigned long ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t value) = 0;
+    virtual void flush() {}
+    size_t print(const char *text) { return printf("%s", text); }
+    size_t println(const char *text = "") { return printf("%s\n", text); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char buffer[256];
+        va_list arguments;
+        va_start(arguments, format);
+        int length = vsnprintf(buffer, sizeof(buffer), format, arguments);
+        va_end(arguments);
+        for(int i = 0; i < length && i < (int)sizeof(buffer) - 1; i++)
+            write(buffer[i]);
+        return length;
+    }
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+class HostSerial : public Stream {
+public:
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    size_t write(uint8_t value) override { return fputc(value, stderr) == EOF ? 0 : 1; }
+};
+
+inline HostSerial Serial;
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+#define portMAX_DELAY 0xFFFFFFFFUL
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portYIELD_FROM_ISR(woken) (void)(woken)
+
+// A counting notification or semaphore: take() waits for a nonzero count
+struct HostSignal {
+    std::mutex mutex;
+    std::condition_variable changed;
+    uint32_t count = 0;
+    uint32_t limit = 0xFFFFFFFF;
+
+    bool take(TickType_t ticks, bool clear)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto ready = [this] { return count > 0; };
+        if(ticks == portMAX_DELAY)
+            changed.wait(lock, ready);
+        else if(!changed.wait_for(lock, std::chrono::milliseconds(ticks), ready))
+            return false;
+        count = clear ? 0 : count - 1;
+        return true;
+    }
+    void give()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(count < limit)
+                count++;
+        }
+        changed.notify_one();
+    }
+};
+
+typedef HostSignal *TaskHandle_t;
+typedef HostSignal *SemaphoreHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+// The notification of the calling thread; threads not created as tasks get one too
+inline HostSignal *&hostCurrentTask()
+{
+    thread_local HostSignal *task = nullptr;
+    if(task == nullptr)
+        task = new HostSignal;
+    return task;
+}
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *, uint32_t, void *parameter,
+                                          UBaseType_t, TaskHandle_t *handle, BaseType_t)
+{
+    HostSignal *task = new HostSignal;
+    std::thread([function, parameter, task] {
+        hostCurrentTask() = task;
+        function(parameter);
+    }).detach();
+    if(handle != nullptr)
+        *handle = task;
+    return pdPASS;
+}
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    HostSignal *task = hostCurrentTask();
+    std::unique_lock<std::mutex> lock(task->mutex);
+    auto ready = [task] { return task->count > 0; };
+    if(ticks == portMAX_DELAY)
+        task->changed.wait(lock, ready);
+    else if(!task->changed.wait_for(lock, std::chrono::milliseconds(ticks), ready))
+        return 0;
+    uint32_t count = task->count;
+    task->count = clear ? 0 : count - 1;
+    return count;
+}
+
+inline BaseType_t xTaskNotifyGive(TaskHandle_t task) { task->give(); return pdPASS; }
+inline void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *) { task->give(); }
+inline bool xPortInIsrContext() { return false; }
+inline void vTaskDelay(TickType_t ticks) { delay(ticks); }
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+    HostSignal *semaphore = new HostSignal;
+    semaphore->limit = 1;
+    return semaphore;
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+    SemaphoreHandle_t semaphore = xSemaphoreCreateBinary();
+    semaphore->give();
+    return semaphore;
+}
+
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+    return semaphore->take(ticks, false) ? pdTRUE : pdFALSE;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) { semaphore->give(); return pdTRUE; }
+
+#endif
@@ -0,0 +1,227 @@
+// Encoder round-trip and transmit task tests for the sending side of Midi.cpp, built on the
+// host with the stand-ins in host/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <future>
+#include <vector>
+#include "Midi.h"
+
+#define ROUND_TRIP_BURSTS 20000
+#define SYSEX_TIMEOUT_MS 2000
+
+// Keeps the packets the Midi class sends, and reads them back through its own parser
+class Loopback : public Midi {
+public:
+    std::vector<std::vector<uint8_t>> packets;
+    std::vector<MidiEvent> events;
+    std::mutex lock;
+
+    Loopback() { setBatchCallback(collect, this); }
+
+    void receive()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for(std::vector<uint8_t> &packet : packets)
+            receivePacket(packet.data(), packet.size());
+        packets.clear();
+    }
+
+private:
+    static void collect(void *context, const MidiEvent *events, size_t count)
+    {
+        Loopback *self = static_cast<Loopback *>(context);
+        self->events.insert(self->events.end(), events, events + count);
+    }
+
+protected:
+    void sendPacket(uint8_t *packet, uint8_t packetSize) override
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        packets.emplace_back(packet, packet + packetSize);
+    }
+};
+
+static std::vector<uint8_t> receivedSysEx;
+
+void fail(const char *what)
+{
+    fprintf(stderr, "Test failed: %s\n", what);
+    exit(EXIT_FAILURE);
+}
+
+// Sends a random channel message through the public API at time 't' and appends what it must
+// decode to to 'expected'. Few channels and kinds, so that running status comes up often.
+void sendRandom(Midi &midi, uint16_t t, std::vector<MidiEvent> &expected)
+{
+    uint8_t channel = rand() % 2, a = rand() & 0x7F, b = rand() & 0x7F;
+    MidiEvent event = {t, 3, {0, a, b}};
+    midi.setTimestamp(t);
+    switch(rand() % 4) {
+    case 0:
+        midi.noteOn(channel, a, b);
+        event.message[0] = 0x90 | channel;
+        break;
+    case 1:
+        midi.controlChange(channel, a, b);
+        event.message[0] = 0xB0 | channel;
+        break;
+    case 2:
+        midi.programChange(channel, a);
+        event.message[0] = 0xC0 | channel;
+        event.size = 2;
+        break;
+    default:
+        midi.pitchBend(channel, a, b);
+        event.message[0] = 0xE0 | channel;
+        break;
+    }
+    expected.push_back(event);
+}
+
+// Exact packets of the aggregating encoder for the cases it treats specially
+void encoderCases()
+{
+    Loopback midi;
+    midi.setAggregation(true, 60000);       // Only flush() and the limits send
+
+    // Same status and time: the status and the second timestamp byte are left out
+    midi.setTimestamp(0x105);
+    midi.noteOn(0, 60, 100);
+    midi.noteOn(0, 64, 100);
+    // Same status, new time: only the status byte is left out
+    midi.setTimestamp(0x106);
+    midi.noteOn(0, 67, 100);
+    // New status at the same time
+    midi.controlChange(0, 7, 90);
+    midi.flush();
+    if(midi.packets != std::vector<std::vector<uint8_t>>{{0x82, 0x85, 0x90, 60, 100, 64, 100, 0x86, 67, 100, 0x86, 0xB0, 7, 90}})
+        fail("running status or repeated timestamp not elided");
+    midi.packets.clear();
+
+    // The high timestamp bits change: the header cannot cover both, so two packets
+    midi.setTimestamp(0x17F);
+    midi.noteOn(1, 60, 1);
+    midi.setTimestamp(0x180);
+    midi.noteOn(1, 61, 1);
+    // A smaller low part under the same header would read as a wrap: two packets again
+    midi.setTimestamp(0x190);
+    midi.noteOn(1, 62, 1);
+    midi.setTimestamp(0x18F);
+    midi.noteOn(1, 63, 1);
+    midi.flush();
+    if(midi.packets != std::vector<std::vector<uint8_t>>{{0x82, 0xFF, 0x91, 60, 1},
+                                   {0x83, 0x80, 0x91, 61, 1, 0x90, 62, 1},
+                                   {0x83, 0x8F, 0x91, 63, 1}})
+        fail("packet not ended on a header or timestamp change");
+    midi.packets.clear();
+
+    // System messages go out on their own, between the packets around them
+    midi.setTimestamp(0x200);
+    midi.noteOn(2, 60, 1);
+    midi.mmcStop();
+    midi.noteOn(2, 61, 1);
+    midi.flush();
+    if(midi.packets != std::vector<std::vector<uint8_t>>{{0x84, 0x80, 0x92, 60, 1},
+                                   {0x84, 0x80, 0xF0, 0x7F, 0x7F, 0x06, 0x01, 0xF7},
+                                   {0x84, 0x80, 0x92, 61, 1}})
+        fail("system message not sent on its own");
+    midi.packets.clear();
+
+    // 20 byte limit: header, timestamp and status, then 2 bytes per control change, so 8 fit
+    midi.setTimestamp(0x300);
+    for(int i = 0; i < 10; i++)
+        midi.controlChange(3, i, i);
+    midi.flush();
+    if(midi.packets.size() != 2 || midi.packets[0].size() != 19 || midi.packets[1].size() != 7)
+        fail("packet size limit not applied");
+    printf("encoder cases: ok\n");
+}
+
+// Random bursts through the real encoder, at random packet sizes, decoded by the real parser
+void roundTrip()
+{
+    Loopback midi;
+    midi.setAggregation(true, 60000);
+    std::vector<MidiEvent> expected;
+    uint32_t messages = 0, packets = 0, bytes = 0;
+    for(int burst = 0; burst < ROUND_TRIP_BURSTS; burst++) {
+        uint8_t limit = MIDI_DEFAULT_PACKET_SIZE + rand() % (MIDI_MAX_PACKET_SIZE - MIDI_DEFAULT_PACKET_SIZE + 1);
+        midi.setMaxPacketSize(limit);
+        expected.clear();
+        midi.events.clear();
+        // Time mostly stands still or creeps, so the low part wraps into the header now and then
+        uint16_t t = rand() & 0x1FFF;
+        for(int i = 1 + rand() % 60; i > 0; i--) {
+            sendRandom(midi, t, expected);
+            if(rand() % 3 == 0)
+                t = (t + rand() % 20) & 0x1FFF;
+        }
+        midi.flush();
+        for(const std::vector<uint8_t> &packet : midi.packets) {
+            if(packet.size() > limit)
+                fail("packet longer than the size limit");
+            bytes += packet.size();
+        }
+        packets += midi.packets.size();
+        midi.receive();
+        bool same = midi.events.size() == expected.size();
+        for(size_t i = 0; same && i < expected.size(); i++)
+            same = midi.events[i].size == expected[i].size && midi.events[i].timestamp == expected[i].timestamp &&
+                   memcmp(midi.events[i].message, expected[i].message, expected[i].size) == 0;
+        if(!same) {
+            fprintf(stderr, "Test failed: burst %d decoded differently, %zu messages sent, %zu decoded\n", burst,
+                    expected.size(), midi.events.size());
+            exit(EXIT_FAILURE);
+        }
+        messages += expected.size();
+    }
+    printf("round trip: %u messages in %u packets, %.2f bytes per message ok\n", messages, packets,
+           (double)bytes / messages);
+}
+
+void collectSysEx(const uint8_t *data, size_t size, uint16_t timestamp)
+{
+    receivedSysEx.assign(data, data + size);
+}
+
+// A SysEx must go out even when nothing else is queued for the transmit task to wake up to
+void sysExIdleTask()
+{
+    static Loopback midi;
+    static uint8_t buffer[64];
+    midi.setSysExBuffer(buffer, sizeof(buffer));
+    midi.setSysExCallback(collectSysEx);
+    if(!midi.startTransmitTask()) {
+        fprintf(stderr, "Test failed: transmit task not started\n");
+        exit(EXIT_FAILURE);
+    }
+    delay(20);      // Lets the task go idle
+
+    static const uint8_t data[] = {0x7D, 0x01, 0x02, 0x03};
+    std::future<bool> sent = std::async(std::launch::async, [] { return midi.sendSysEx(data, sizeof(data)); });
+    if(sent.wait_for(std::chrono::milliseconds(SYSEX_TIMEOUT_MS)) != std::future_status::ready) {
+        fprintf(stderr, "Test failed: sendSysEx() did not return with an idle transmit task\n");
+        fflush(stderr);
+        _Exit(EXIT_FAILURE);
+    }
+    midi.receive();
+    if(!sent.get() || receivedSysEx != std::vector<uint8_t>(data, data + sizeof(data))) {
+        fprintf(stderr, "Test failed: SysEx not sent by the transmit task\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("SysEx with an idle transmit task: ok\n");
+}
+
+int main(void)
+{
+    srand(1);
+    encoderCases();
+    roundTrip();
+    sysExIdleTask();
+    // The transmit task never ends; leave without waiting for it
+    fflush(stdout);
+    _Exit(EXIT_SUCCESS);
+}
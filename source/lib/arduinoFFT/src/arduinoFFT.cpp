@@ -523,5 +523,28 @@ const T ArduinoFFT<T>::_WindowCompensationFactors[11] = {
     1.0 // Custom, precompiled value.
 };
 
+// The inner kernels go to the section FFT_IRAM_ATTR names. GCC ignores section
+// attributes on template definitions, so they are attached per instantiation.
+#ifdef FFT_SQRT_APPROXIMATION
+#define FFT_INSTANTIATE_SQRT(T)                                                 \
+  template FFT_IRAM_ATTR float ArduinoFFT<T>::sqrt_internal(float) const;       \
+  template FFT_IRAM_ATTR double ArduinoFFT<T>::sqrt_internal(double) const;
+#else
+#define FFT_INSTANTIATE_SQRT(T)
+#endif
+
+#define FFT_INSTANTIATE_KERNELS(T)                                              \
+  template FFT_IRAM_ATTR void ArduinoFFT<T>::compute(                          \
+      T *, T *, uint_fast16_t, uint_fast8_t, FFTDirection) const;               \
+  template FFT_IRAM_ATTR void ArduinoFFT<T>::complexToMagnitude(               \
+      T *, T *, uint_fast16_t) const;                                          \
+  template FFT_IRAM_ATTR void ArduinoFFT<T>::windowing(                        \
+      T *, uint_fast16_t, FFTWindow, FFTDirection, T *, bool);                  \
+  template FFT_IRAM_ATTR void ArduinoFFT<T>::swap(T *, T *) const;             \
+  FFT_INSTANTIATE_SQRT(T)
+
+FFT_INSTANTIATE_KERNELS(double)
+FFT_INSTANTIATE_KERNELS(float)
+
 template class ArduinoFFT<double>;
 template class ArduinoFFT<float>;
@@ -53,6 +53,12 @@
   #endif
 #endif
 
+// Section attribute for the inner kernels (compute, windowing, magnitudes),
+// e.g. -DFFT_IRAM_ATTR=IRAM_ATTR to run them from internal RAM on the ESP32
+#ifndef FFT_IRAM_ATTR
+#define FFT_IRAM_ATTR
+#endif
+
 #define FFT_LIB_REV 0x20
 
 template <typename T> class ArduinoFFT {
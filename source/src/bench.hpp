@@ -0,0 +1,137 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <BLEMidi.h>
+
+// On-device frame-time benchmark: runs the full analysis of a synthetic frame
+// of the configured length BENCH_FRAMES times, first idle and then while a
+// task on the radio core keeps WiFi and BLE busy. Flash both the esp32dev and
+// the esp32dev_iram environment and compare the 'b' output to see what the
+// placement profile buys.
+#define BENCH_FRAMES 500
+#define BENCH_LOAD_PORT 5005          // UDP broadcast target on the access point
+#define BENCH_LOAD_PACKET 1024        // Bytes per broadcast
+#define BENCH_LOAD_MIDI_CONTROLLER 16 // General purpose controller 1, ignored by most synths
+#define BENCH_LOAD_CORE 0
+
+static i2s_sample_t *benchInput;
+static float *benchReal;
+static float *benchImag;
+static std::atomic<bool> benchLoadRunning(false);
+// Given by the load task once it is done with the radios and the counters. Not a
+// task notification: the loop task also gets those from the capture pipeline.
+static SemaphoreHandle_t benchLoadDone = NULL;
+static uint32_t benchLoadPackets = 0;
+static uint32_t benchLoadMidi = 0;
+
+// Floods the access point with broadcasts and the BLE link with controller messages
+void benchLoadTaskMain(void *parameter)
+{
+  WiFiUDP udp;
+  static uint8_t payload[BENCH_LOAD_PACKET];
+  IPAddress broadcast = WiFi.softAPIP();
+  broadcast[3] = 255;
+  uint8_t value = 0;
+
+  while (benchLoadRunning.load())
+  {
+    if (udp.beginPacket(broadcast, BENCH_LOAD_PORT))
+    {
+      udp.write(payload, sizeof(payload));
+      if (udp.endPacket())
+        benchLoadPackets++;
+    }
+    if (BLEMidiServer.isConnected())
+    {
+      BLEMidiServer.controlChange(15, BENCH_LOAD_MIDI_CONTROLLER, value++ & 0x7F);
+      BLEMidiServer.flush(); // One notification per message, as without aggregation
+      benchLoadMidi++;
+    }
+    vTaskDelay(1);
+  }
+  xSemaphoreGive(benchLoadDone);
+  vTaskDelete(NULL);
+}
+
+// Times BENCH_FRAMES analyses of the synthetic frame into 'stats'
+void benchRunFrames(ProfileStage &stats)
+{
+  memset(&stats, 0, sizeof(stats));
+  powerBeginDsp();
+  for (int frame = 0; frame < BENCH_FRAMES; frame++)
+  {
+    HighPassState state = {0.0f, 0.0f};
+    float rmsLevel;
+    uint32_t start = ESP.getCycleCount();
+    analyseWindow(benchInput, benchReal, benchImag, analysisConfig.samples, state, rmsLevel);
+    profileAccumulate(stats, ESP.getCycleCount() - start);
+  }
+  powerEndDsp();
+}
+
+void benchPrint(const char *name, const ProfileStage &stats)
+{
+  float cyclesPerUs = (float)getCpuFrequencyMhz();
+  Serial.printf("  %-6s min %8.1f  mean %8.1f  p99 %8.1f  max %8.1f us\r\n", name,
+                stats.minCycles / cyclesPerUs, (float)stats.totalCycles / stats.count / cyclesPerUs,
+                profilePercentile(stats, 0.99f) / cyclesPerUs, stats.maxCycles / cyclesPerUs);
+}
+
+void benchFrameTime()
+{
+  // Scratch outside the analysis arena, which is sized for the live buffers only
+  int samples = analysisConfig.samples;
+  benchInput = (i2s_sample_t *)malloc(samples * sizeof(i2s_sample_t));
+  benchReal = (float *)malloc(samples * sizeof(float));
+  benchImag = (float *)malloc(samples * sizeof(float));
+  if (benchInput == NULL || benchReal == NULL || benchImag == NULL)
+  {
+    Serial.println("Not enough memory for the benchmark");
+    free(benchInput);
+    free(benchReal);
+    free(benchImag);
+    return;
+  }
+
+  // A 440 Hz tone in the layout the I2S driver delivers
+  for (int i = 0; i < samples; i++)
+  {
+    float sample = 0.3f * sinf(2.0f * PI * 440.0f * i / analysisConfig.samplingFrequency);
+#if I2S_SAMPLE_BITS == 16
+    benchInput[i ^ 1] = (i2s_sample_t)(sample * I2S_SAMPLE_SCALE);
+#else
+    benchInput[i] = (i2s_sample_t)(sample * I2S_SAMPLE_SCALE) * 256;
+#endif
+  }
+
+  static ProfileStage idle, loaded;
+  Serial.printf("Frame time, %d x %d samples, placement profile %s:\r\n", BENCH_FRAMES, samples,
+                DSP_PLACEMENT ? "on" : "off");
+  benchRunFrames(idle);
+  benchPrint("idle", idle);
+
+  benchLoadPackets = 0;
+  benchLoadMidi = 0;
+  if (benchLoadDone == NULL)
+    benchLoadDone = xSemaphoreCreateBinary();
+  benchLoadRunning.store(true);
+  bool loadStarted = benchLoadDone != NULL &&
+                     xTaskCreatePinnedToCore(benchLoadTaskMain, "benchLoad", 4096, NULL, 1, NULL, BENCH_LOAD_CORE) == pdPASS;
+  if (!loadStarted)
+    Serial.println("  Cannot start the load task, 'loaded' runs without radio traffic");
+  vTaskDelay(pdMS_TO_TICKS(100)); // Let the radio traffic build up
+  benchRunFrames(loaded);
+  benchLoadRunning.store(false);
+  // No traffic may outlive the command, and the counters are final only then
+  if (loadStarted)
+    xSemaphoreTake(benchLoadDone, portMAX_DELAY);
+  benchPrint("loaded", loaded);
+  Serial.printf("  load: %u UDP broadcasts, %u MIDI messages\r\n", benchLoadPackets, benchLoadMidi);
+
+  free(benchInput);
+  free(benchReal);
+  free(benchImag);
+
+  // The stage probes inside analyseWindow() counted the benchmark frames too
+  resetProfile();
+}
@@ -1,9 +1,51 @@
 #include <Arduino.h>
 #include "record.hpp"
+#include "bench.hpp"
 
 void commandSetup()
 {
-    init_i2s();
+    // The I2S driver is shared with note detection and installed by detect_setup()
+}
+
+void changeAnalysisConfig(const String &line)
+{
+    AnalysisConfig config = analysisConfig;
+    const char *error = parseAnalysisConfig(line.c_str(), config);
+    if (error == NULL && line.length() > 0)
+        error = reconfigureAnalysis(config);
+    if (error != NULL)
+        Serial.printf("Configuration unchanged: %s\r\n", error);
+    printAnalysisConfig();
+}
+
+void changePitchTrackConfig(const String &line)
+{
+    PitchTrackConfig config = pitchTrackConfig;
+    const char *error = parsePitchTrackConfig(line.c_str(), config);
+    if (error != NULL)
+        Serial.printf("Configuration unchanged: %s\r\n", error);
+    else
+        pitchTrackConfig = config;
+
+    char text[96];
+    formatPitchTrackConfig(pitchTrackConfig, text, sizeof(text));
+    Serial.printf("Pitch track: %s\r\n", text);
+    Serial.printf("  frames %u, raw note changes %u, tracked note changes %u, suppressed %u, bridged dropouts %u\r\n",
+                  pitchTrackStats.frames, pitchTrackStats.rawChanges, pitchTrackStats.noteChanges,
+                  pitchTrackStats.suppressedChanges, pitchTrackStats.bridgedDropouts);
+    resetPitchTrackStats();
+}
+
+void changeMidiOutConfig(const String &line)
+{
+    MidiOutConfig config = midiOutConfig;
+    const char *error = parseMidiOutConfig(line.c_str(), config);
+    if (error != NULL)
+        Serial.printf("Configuration unchanged: %s\r\n", error);
+    else
+        midiOutConfig = config;
+    printMidiOut();
+    resetMidiOutStats();
 }
 
 void commandHandler()
@@ -15,8 +57,20 @@ void commandHandler()
         switch (ch)
         {
         case 'g':
+#if I2S_SAMPLE_BITS != 32
+            Serial.println("Recording needs 32-bit I2S capture");
+            break;
+#endif
+            if (analysisConfig.samplingFrequency != SAMPLE_RATE)
+            {
+                Serial.printf("Recording needs rate=%d\r\n", SAMPLE_RATE);
+                break;
+            }
             Serial.printf("Go !\r\n");
             filename = "/recording_" + String(millis()) + ".wav";
+#if CAPTURE_PIPELINE
+            pausePipeline();
+#endif
 
             if (record_audio_to_wav(filename.c_str()))
             {
@@ -26,7 +80,50 @@ void commandHandler()
             {
                 Serial.println("Recording failed!");
             }
+#if I2S_USE_EVENT_QUEUE
+            resetI2SEvents();
+#endif
+#if CAPTURE_PIPELINE
+            resumePipeline();
+#endif
+            break;
+        case 'i':
+            printI2SStats();
+            resetI2SStats();
+            break;
+        case 'w':
+            printPowerStats();
+            break;
+        case 'f':
+            powerCycleMaxClock();
+            break;
+        case 'c':
+            // "c" prints the analysis configuration, "c key=value ..." changes it
+            changeAnalysisConfig(Serial.readStringUntil('\n'));
+            break;
+        case 't':
+            // "t" prints the pitch tracker settings and counters, "t key=value ..." changes them
+            changePitchTrackConfig(Serial.readStringUntil('\n'));
+            break;
+        case 'm':
+            // "m" prints the MIDI output settings and counters, "m glide=1 range=2 ..." changes them
+            changeMidiOutConfig(Serial.readStringUntil('\n'));
+            break;
+        case 'b':
+            benchFrameTime();
+            break;
+#if PROFILING
+        case 'p':
+            printProfile(powerMaxMhz);
+            resetProfile();
+            break;
+#endif
+#if CAPTURE_PIPELINE
+        case 'u':
+            printPipelineStats();
+            resetPipelineStats();
             break;
+#endif
         default:
             Serial.printf("Key: %d %c\r\n", ch, ch);
             break;
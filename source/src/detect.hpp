@@ -1,7 +1,14 @@
 #include <Arduino.h>
 
+#include <atomic>
 #include <driver/i2s.h>
-#include <arduinoFFT.h>
+
+#include "log.hpp"
+#include "power.hpp"
+#include "profile.hpp"
+#include "dsp.hpp"
+#include "quantize.hpp"
+#include "pitchtrack.hpp"
 
 // I2S Configuration for INMP441
 #define I2S_WS 2   // Word Select (LRCLK)
@@ -11,35 +18,90 @@
 
 #define LED 5
 
-// FFT configuration
-#define SAMPLES 512
-#define SAMPLING_FREQUENCY 16000 // 16kHz sampling rate
-
-// Create FFT object - CHANGED TO FLOAT
-ArduinoFFT<float> FFT = ArduinoFFT<float>();
-
-// Arrays for FFT computation - CHANGED TO FLOAT
-float vReal[SAMPLES];
-float vImag[SAMPLES];
+// I2S DMA geometry. Each DMA buffer holds I2S_DMA_BUF_LEN samples, so the
+// driver can hold I2S_DMA_BUF_COUNT * I2S_DMA_BUF_LEN / sample rate seconds
+// of audio before it overruns (8 x 128 = 64 ms at 16 kHz).
+#define I2S_DMA_BUF_COUNT 8
+#define I2S_DMA_BUF_LEN 128
+
+// Wake the audio path per completed DMA buffer using the driver's event queue
+// instead of blocking in i2s_read(); also enables overrun and delay statistics
+#define I2S_USE_EVENT_QUEUE 1
+#define I2S_EVENT_QUEUE_LEN 16
+
+// Capture pipeline: a task on core 0 reads, converts and filters frame n+1
+// into one half of a ping-pong buffer while loop() on core 1 runs the FFT and
+// peak search on frame n. Works on whole frames only, so it needs the fixed
+// analysis engine.
+#define CAPTURE_PIPELINE 0
+#define CAPTURE_TASK_CORE 0
+#define CAPTURE_TASK_PRIORITY 5
+#define CAPTURE_TASK_STACK 4096
+
+#if CAPTURE_PIPELINE && ADAPTIVE_FFT
+#error "CAPTURE_PIPELINE hands over whole frames; set ADAPTIVE_FFT to 0"
+#endif
+
+// Arrays for FFT computation - CHANGED TO FLOAT, carved from the analysis arena
+float *vReal = NULL;
+float *vImag = NULL;
 
 // I2S buffer
-int32_t i2sBuffer[SAMPLES];
+#if I2S_SAMPLE_BITS == 16
+#define I2S_BITS_PER_SAMPLE I2S_BITS_PER_SAMPLE_16BIT
+#else
+#define I2S_BITS_PER_SAMPLE I2S_BITS_PER_SAMPLE_32BIT
+#endif
+
+i2s_sample_t *i2sBuffer = NULL;
+
+// Arena for the largest frame: the kernel tables, vReal, vImag, i2sBuffer and
+// the pipeline's two capture frames, each with room for alignment
+#define DETECT_ARENA_BYTES                                                      \
+  (DSP_ARENA_BYTES(ANALYSIS_MAX_SAMPLES) + 5 * 16 +                             \
+   ANALYSIS_MAX_SAMPLES * (2 * sizeof(float) + sizeof(i2s_sample_t) +          \
+                           CAPTURE_PIPELINE * 2 * sizeof(float)))
+
+// Loudness of the last frame, 0..1, see rmsToLevel()
+float detectLevel = 0.0f;
+
+// When the last sample of the analysed frame was captured, on the
+// esp_timer_get_time() clock millis() and micros() also run on
+int64_t detectCaptureUs = 0;
+
+#if I2S_USE_EVENT_QUEUE
+QueueHandle_t i2sEventQueue = NULL;
+#endif
+
+// Capture statistics, used to tune the DMA geometry for the shortest safe pipeline
+struct I2SStats
+{
+  uint32_t frames;       // Frames handed to the analysis
+  uint32_t overruns;     // DMA buffers dropped because nobody read them in time
+  uint32_t readErrors;   // Failed or short reads
+  uint32_t maxBacklog;   // Most completed DMA buffers waiting when a read started
+  uint32_t lastDelayUs;  // Last DMA-buffer-complete to analysis-start delay
+  uint32_t maxDelayUs;
+  uint64_t totalDelayUs;
+  int64_t lastBufferUs;  // Time the most recent DMA buffer completed
+};
 
-// Note names array
-const char *noteNames[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+I2SStats i2sStats = {};
+
+static HighPassState highPassState = {0.0f, 0.0f};
 
 // Initialize I2S for INMP441
 void initI2S()
 {
   i2s_config_t i2s_config = {
       .mode = i2s_mode_t(I2S_MODE_MASTER | I2S_MODE_RX),
-      .sample_rate = SAMPLING_FREQUENCY,
-      .bits_per_sample = I2S_BITS_PER_SAMPLE_32BIT, // INMP441 outputs 24-bit in 32-bit container
-      .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,  // Mono microphone
+      .sample_rate = (uint32_t)analysisConfig.samplingFrequency,
+      .bits_per_sample = I2S_BITS_PER_SAMPLE,      // INMP441 outputs 24-bit in 32-bit container
+      .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT, // Mono microphone
       .communication_format = I2S_COMM_FORMAT_STAND_I2S,
       .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,
-      .dma_buf_count = 4,
-      .dma_buf_len = 1024,
+      .dma_buf_count = I2S_DMA_BUF_COUNT,
+      .dma_buf_len = I2S_DMA_BUF_LEN,
       .use_apll = false,
       .tx_desc_auto_clear = false,
       .fixed_mclk = 0};
@@ -50,281 +112,515 @@ void initI2S()
       .data_out_num = I2S_PIN_NO_CHANGE,
       .data_in_num = I2S_SD};
 
-  i2s_driver_install(I2S_PORT, &i2s_config, 0, NULL);
+#if I2S_USE_EVENT_QUEUE
+  esp_err_t result = i2s_driver_install(I2S_PORT, &i2s_config, I2S_EVENT_QUEUE_LEN, &i2sEventQueue);
+#else
+  esp_err_t result = i2s_driver_install(I2S_PORT, &i2s_config, 0, NULL);
+#endif
+  if (result != ESP_OK)
+  {
+    Serial.printf("I2S driver install failed: %d\r\n", result);
+  }
   i2s_set_pin(I2S_PORT, &pin_config);
 }
 
-// Read I2S samples from INMP441
-bool readI2SSamples()
+#if I2S_USE_EVENT_QUEUE
+// Drop pending DMA events, e.g. after another reader (recording) used the driver
+void resetI2SEvents()
 {
-  size_t bytes_read = 0;
-
-  // Read samples from I2S
-  esp_err_t result = i2s_read(I2S_PORT, i2sBuffer, sizeof(i2sBuffer), &bytes_read, portMAX_DELAY);
+  xQueueReset(i2sEventQueue);
+}
 
-  if (result != ESP_OK || bytes_read != sizeof(i2sBuffer))
+// Account one driver event; returns true when it reports a completed DMA buffer
+bool handleI2SEvent(const i2s_event_t &event)
+{
+  if (event.type == I2S_EVENT_RX_Q_OVF)
   {
-    Serial.println("Failed to read I2S data");
+    i2sStats.overruns++;
     return false;
   }
-
-  return true;
-}
-
-// Convert I2S 32-bit samples to normalized float values - CHANGED TO FLOAT
-void convertI2SToFloat()
-{ // Renamed from convertI2SToDouble
-  for (int i = 0; i < SAMPLES; i++)
+  if (event.type != I2S_EVENT_RX_DONE)
   {
-    // INMP441 provides 24-bit data in upper 24 bits of 32-bit word
-    // Right-shift by 8 to get 24-bit signed value
-    int32_t sample24 = i2sBuffer[i] >> 8;
-
-    // Normalize to range [-1.0, 1.0] - CHANGED DENOMINATOR TO FLOAT LITERAL
-    vReal[i] = (float)sample24 / 8388608.0f; // 2^23 for 24-bit signed
-    vImag[i] = 0.0f;                         // Clear imaginary part - CHANGED TO FLOAT LITERAL
+    return false;
   }
+  i2sStats.lastBufferUs = esp_timer_get_time();
+  return true;
 }
 
-// Function to convert frequency to musical note - PARAMETER CHANGED TO FLOAT
-String frequencyToNote(float frequency)
-{ // Parameter changed to float
-  if (frequency < 80.0f)
-    return "Too Low"; // CHANGED TO FLOAT LITERAL
-  if (frequency > 5000.0f)
-    return "Too High"; // CHANGED TO FLOAT LITERAL
-
-  // A4 = 440 Hz reference
-  float A4 = 440.0f; // CHANGED TO FLOAT LITERAL
+// Read samples [offset, offset + count) of the frame, sleeping until the
+// driver reports completed DMA buffers instead of blocking inside i2s_read()
+bool readI2SSamples(int offset, int count)
+{
+  uint8_t *destination = (uint8_t *)&i2sBuffer[offset];
+  size_t remaining = count * sizeof(i2sBuffer[0]);
+  i2s_event_t event;
 
-  // Calculate semitones from A4 - CHANGED TO FLOAT LOG2
-  float semitones = 12.0f * log2f(frequency / A4); // Use log2f for float
-  int semitonesRounded = round(semitones);
+  while (remaining > 0)
+  {
+    // Account events that arrived while we were busy so overruns are not lost;
+    // each pending buffer event is one DMA buffer we have fallen behind by
+    uint32_t backlog = 0;
+    while (xQueueReceive(i2sEventQueue, &event, 0) == pdTRUE)
+    {
+      if (handleI2SEvent(event))
+        backlog++;
+    }
+    if (backlog > i2sStats.maxBacklog)
+      i2sStats.maxBacklog = backlog;
 
-  // Calculate octave and note index
-  int octave = 4 + (semitonesRounded + 9) / 12;
-  int noteIndex = ((semitonesRounded + 9) % 12 + 12) % 12;
+    // Take whatever is complete without waiting; a timeout just means a short read
+    size_t bytes_read = 0;
+    esp_err_t result = i2s_read(I2S_PORT, destination, remaining, &bytes_read, 0);
+    if (result != ESP_OK && result != ESP_ERR_TIMEOUT)
+    {
+      i2sStats.readErrors++;
+      LOG_ERROR("Failed to read I2S data");
+      return false;
+    }
+    destination += bytes_read;
+    remaining -= bytes_read;
 
-  // Format result - Ensure String conversion handles float correctly
-  String result = String(noteNames[noteIndex]) + String(octave);
-  result += " (" + String(frequency, 1) + " Hz)";
+    // Sleep until the next DMA buffer completes
+    while (remaining > 0 && xQueueReceive(i2sEventQueue, &event, portMAX_DELAY) == pdTRUE)
+    {
+      if (handleI2SEvent(event))
+        break;
+    }
+  }
 
-  return result;
+  return true;
 }
-
-// Apply simple high-pass filter to remove DC offset - CHANGED TO FLOAT
-float applyHighPassFilter()
+#else
+// Read samples [offset, offset + count) of the frame from INMP441
+bool readI2SSamples(int offset, int count)
 {
-  static float previousSample = 0.0f; // CHANGED TO FLOAT
-  static float previousOutput = 0.0f; // CHANGED TO FLOAT
-  const float alpha = 0.95f;          // High-pass filter coefficient - CHANGED TO FLOAT
-  float peak = 0.0;
+  size_t bytes_read = 0;
+  size_t bytes_wanted = count * sizeof(i2sBuffer[0]);
+
+  // Read samples from I2S
+  esp_err_t result = i2s_read(I2S_PORT, &i2sBuffer[offset], bytes_wanted, &bytes_read, portMAX_DELAY);
+  i2sStats.lastBufferUs = esp_timer_get_time();
 
-  for (int i = 0; i < SAMPLES; i++)
+  if (result != ESP_OK || bytes_read != bytes_wanted)
   {
-    float currentSample = vReal[i];
-    if (currentSample > peak)
-      peak = currentSample;                                           // CHANGED TO FLOAT
-    float output = alpha * (previousOutput + currentSample - previousSample); // CHANGED TO FLOAT
-    previousOutput = output;
-    previousSample = currentSample;
-    vReal[i] = output;
+    i2sStats.readErrors++;
+    LOG_ERROR("Failed to read I2S data");
+    return false;
   }
-  return peak;
+
+  return true;
 }
+#endif
 
-// Main function to detect musical note from I2S microphone
-String detectMusicalNote()
+// Account the delay between the newest DMA buffer of a frame completing
+// (at bufferUs) and the start of its analysis (at analysisUs); once per frame
+void recordI2SDelay(int64_t bufferUs, int64_t analysisUs)
 {
-  // Read samples from I2S microphone
-  if (!readI2SSamples())
+  uint32_t delayUs = (uint32_t)(analysisUs - bufferUs);
+  i2sStats.frames++;
+  i2sStats.lastDelayUs = delayUs;
+  i2sStats.totalDelayUs += delayUs;
+  if (delayUs > i2sStats.maxDelayUs)
+    i2sStats.maxDelayUs = delayUs;
+}
+
+void printI2SStats()
+{
+  Serial.printf("I2S: %d x %d samples, %d bit, %s\r\n", I2S_DMA_BUF_COUNT, I2S_DMA_BUF_LEN, I2S_SAMPLE_BITS,
+                I2S_USE_EVENT_QUEUE ? "event queue" : "blocking read");
+  Serial.printf("  DMA buffering: %.1f ms\r\n", 1000.0f * I2S_DMA_BUF_COUNT * I2S_DMA_BUF_LEN / analysisConfig.samplingFrequency);
+  Serial.printf("  Frames: %u  Overruns: %u  Read errors: %u  Max backlog: %u buffers\r\n",
+                i2sStats.frames, i2sStats.overruns, i2sStats.readErrors, i2sStats.maxBacklog);
+  if (i2sStats.frames > 0)
   {
-    return "I2S Read Error";
+    Serial.printf("  Buffer-to-analysis delay: last %u us, mean %u us, max %u us\r\n",
+                  i2sStats.lastDelayUs, (uint32_t)(i2sStats.totalDelayUs / i2sStats.frames), i2sStats.maxDelayUs);
   }
+}
 
-  // Convert I2S samples to float array - FUNCTION CALL CHANGED
-  convertI2SToFloat();
+void resetI2SStats()
+{
+  i2sStats = I2SStats();
+}
 
-  // Apply high-pass filter to remove DC offset
-  float peak = applyHighPassFilter();
-  Serial.printf("Peak: %f ", peak);
+#if CAPTURE_PIPELINE
+enum FrameState : uint8_t
+{
+  FRAME_FREE,
+  FRAME_FILLING, // Owned by the capture task
+  FRAME_READY,   // Published, waiting for the analysis
+  FRAME_IN_USE   // Owned by the analysis
+};
+
+// One half of the ping-pong buffer; ownership moves between the tasks
+// only through compare-and-swap on 'state'
+struct CaptureFrame
+{
+  float *samples; // High-pass filtered time-domain samples, from the arena
+  float rms;
+  int64_t bufferUs; // When the last DMA buffer of the frame completed
+  std::atomic<uint32_t> sequence;
+  std::atomic<uint8_t> state;
+};
+
+struct PipelineStats
+{
+  uint32_t produced;
+  uint32_t consumed;
+  uint32_t dropped;        // Ready frames replaced before the analysis took them
+  uint64_t captureBusyUs;  // Conversion, filtering and RMS, excluding the I2S wait
+  uint64_t analysisBusyUs; // FFT and peak search
+  int64_t windowStartUs;
+};
+
+static CaptureFrame captureFrames[2];
+static PipelineStats pipelineStats = {};
+static TaskHandle_t analysisTask = NULL;
+static int analysisCore = 1;
+static std::atomic<bool> capturePauseRequest(false);
+static std::atomic<bool> capturePaused(false);
+
+// Claim a frame the analysis does not own: a free one, else the oldest ready one
+CaptureFrame *claimCaptureFrame()
+{
+  for (;;)
+  {
+    for (CaptureFrame &frame : captureFrames)
+    {
+      uint8_t expected = FRAME_FREE;
+      if (frame.state.compare_exchange_strong(expected, FRAME_FILLING, std::memory_order_acquire))
+        return &frame;
+    }
 
-  // Apply window function to reduce spectral leakage
-  FFT.windowing(vReal, SAMPLES, FFT_WIN_TYP_HAMMING, FFT_FORWARD);
+    CaptureFrame *oldest = NULL;
+    for (CaptureFrame &frame : captureFrames)
+    {
+      if (frame.state.load(std::memory_order_acquire) == FRAME_READY &&
+          (oldest == NULL || frame.sequence.load() < oldest->sequence.load()))
+        oldest = &frame;
+    }
+    uint8_t expected = FRAME_READY;
+    if (oldest != NULL && oldest->state.compare_exchange_strong(expected, FRAME_FILLING, std::memory_order_acquire))
+    {
+      pipelineStats.dropped++;
+      return oldest;
+    }
+  }
+}
 
-  // Compute FFT
-  FFT.compute(vReal, vImag, SAMPLES, FFT_FORWARD);
+// Core 0: capture, conversion and preprocessing of the next frame
+void captureTaskMain(void *parameter)
+{
+  HighPassState state = {0.0f, 0.0f};
+  uint32_t sequence = 0;
 
-  // Compute magnitudes
-  FFT.complexToMagnitude(vReal, vImag, SAMPLES);
+  for (;;)
+  {
+    if (capturePauseRequest.load())
+    {
+      capturePaused.store(true);
+      vTaskDelay(pdMS_TO_TICKS(10));
+      continue;
+    }
+    capturePaused.store(false);
 
-  // Find peak frequency (ignore DC component and very low frequencies)
-  float maxMagnitude = 0; // CHANGED TO FLOAT
-  int peakIndex = 0;
+    PROFILE_BEGIN(PROFILE_I2S_WAIT);
+    int samples = analysisConfig.samples;
+    bool captured = readI2SSamples(0, samples);
+    PROFILE_END(PROFILE_I2S_WAIT);
+    if (!captured)
+    {
+      vTaskDelay(pdMS_TO_TICKS(200));
+      continue;
+    }
 
-  // Focus on musical range (80Hz to 5kHz)
-  int minIndex = max(1, (int)((80.0f * SAMPLES) / SAMPLING_FREQUENCY));             // CHANGED TO FLOAT LITERAL
-  int maxIndex = min(SAMPLES / 2, (int)((5000.0f * SAMPLES) / SAMPLING_FREQUENCY)); // CHANGED TO FLOAT LITERAL
+    int64_t busyStart = esp_timer_get_time();
+    powerBeginDsp();
+    CaptureFrame *frame = claimCaptureFrame();
+    PROFILE_BEGIN(PROFILE_CONVERSION);
+    convertI2SToFloat(i2sBuffer, frame->samples, samples);
+    PROFILE_END(PROFILE_CONVERSION);
+    PROFILE_BEGIN(PROFILE_HIGH_PASS);
+    applyHighPassFilter(frame->samples, samples, state);
+    PROFILE_END(PROFILE_HIGH_PASS);
+    PROFILE_BEGIN(PROFILE_RMS);
+    frame->rms = calculateRMS(frame->samples, samples);
+    PROFILE_END(PROFILE_RMS);
+    powerEndDsp();
+    frame->bufferUs = i2sStats.lastBufferUs;
+    frame->sequence.store(++sequence);
+    frame->state.store(FRAME_READY, std::memory_order_release);
+
+    pipelineStats.produced++;
+    pipelineStats.captureBusyUs += esp_timer_get_time() - busyStart;
+    xTaskNotifyGive(analysisTask);
+  }
+}
 
-  for (int i = minIndex; i < maxIndex; i++)
+// Core 1: wait for and take ownership of the newest published frame
+CaptureFrame *takeCaptureFrame()
+{
+  for (;;)
   {
-    if (vReal[i] > maxMagnitude)
+    CaptureFrame *newest = NULL;
+    for (CaptureFrame &frame : captureFrames)
     {
-      maxMagnitude = vReal[i];
-      peakIndex = i;
+      if (frame.state.load(std::memory_order_acquire) == FRAME_READY &&
+          (newest == NULL || frame.sequence.load() > newest->sequence.load()))
+        newest = &frame;
     }
+    uint8_t expected = FRAME_READY;
+    if (newest != NULL && newest->state.compare_exchange_strong(expected, FRAME_IN_USE, std::memory_order_acquire))
+      return newest;
+    if (newest == NULL)
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
   }
+}
 
-  // Check if we found a significant peak
-  if (maxMagnitude < 10.0f)
-  { // Adjust threshold based on your environment - CHANGED TO FLOAT LITERAL
-    Serial.printf("maxMagnitude(1): %f\r\n", maxMagnitude);
-    return "No Clear Note";
+void releaseCaptureFrame(CaptureFrame *frame, int64_t busyStart)
+{
+  frame->state.store(FRAME_FREE, std::memory_order_release);
+  pipelineStats.consumed++;
+  pipelineStats.analysisBusyUs += esp_timer_get_time() - busyStart;
+}
+
+void setupPipeline()
+{
+  for (CaptureFrame &frame : captureFrames)
+  {
+    frame.sequence.store(0);
+    frame.state.store(FRAME_FREE);
   }
+  // detect_setup() runs in the loop() task, which does the analysis
+  analysisTask = xTaskGetCurrentTaskHandle();
+  analysisCore = xPortGetCoreID();
+  pipelineStats.windowStartUs = esp_timer_get_time();
+  xTaskCreatePinnedToCore(captureTaskMain, "capture", CAPTURE_TASK_STACK, NULL,
+                          CAPTURE_TASK_PRIORITY, NULL, CAPTURE_TASK_CORE);
+}
 
-  // Calculate frequency from peak index - CHANGED TO FLOAT
-  float peakFrequency = ((float)peakIndex * SAMPLING_FREQUENCY) / SAMPLES; // CHANGED TO FLOAT CAST AND CALC
+// Stop the capture task between frames, e.g. while recording uses the driver
+void pausePipeline()
+{
+  capturePauseRequest.store(true);
+  while (!capturePaused.load())
+    vTaskDelay(pdMS_TO_TICKS(1));
+}
 
-  // Apply quadratic interpolation for better frequency resolution - CHANGED TO FLOAT
-  if (peakIndex > minIndex && peakIndex < maxIndex - 1)
-  {
-    float y1 = vReal[peakIndex - 1]; // CHANGED TO FLOAT
-    float y2 = vReal[peakIndex];     // CHANGED TO FLOAT
-    float y3 = vReal[peakIndex + 1]; // CHANGED TO FLOAT
+void resumePipeline()
+{
+  capturePauseRequest.store(false);
+}
 
-    float a = (y1 - 2.0f * y2 + y3) / 2.0f; // CHANGED TO FLOAT LITERALS
-    float b = (y3 - y1) / 2.0f;             // CHANGED TO FLOAT LITERALS
+void printPipelineStats()
+{
+  int64_t now = esp_timer_get_time();
+  float elapsedUs = (float)(now - pipelineStats.windowStartUs);
+
+  Serial.printf("Pipeline: produced %u, consumed %u, dropped %u frames\r\n",
+                pipelineStats.produced, pipelineStats.consumed, pipelineStats.dropped);
+  Serial.printf("  Core %d capture:  %.1f%%\r\n", CAPTURE_TASK_CORE, 100.0f * pipelineStats.captureBusyUs / elapsedUs);
+  Serial.printf("  Core %d analysis: %.1f%%\r\n", analysisCore, 100.0f * pipelineStats.analysisBusyUs / elapsedUs);
+  Serial.printf("  Analysis rate: %.1f frames/s\r\n", 1e6f * pipelineStats.consumed / elapsedUs);
+}
 
-    if (a != 0.0f)
-    {                                                                                   // CHANGED TO FLOAT LITERAL
-      float peakOffset = -b / (2.0f * a);                                               // CHANGED TO FLOAT LITERALS
-      peakFrequency = ((float)(peakIndex + peakOffset) * SAMPLING_FREQUENCY) / SAMPLES; // CHANGED TO FLOAT CAST AND CALC
-    }
+void resetPipelineStats()
+{
+  pipelineStats = PipelineStats();
+  pipelineStats.windowStartUs = esp_timer_get_time();
+}
+#endif
+
+#if !CAPTURE_PIPELINE
+// During silence, stop the microphone for a while so the I2S DMA does not hold
+// the clocks up; the frame read after restarting probes for a new note
+void sleepDuringSilence()
+{
+#if POWER_SILENCE_SLEEP_MS > 0
+  if (!powerIsSilent())
+    return;
+
+  powerEnterSilenceSleep();
+  i2s_stop(I2S_PORT);
+  vTaskDelay(pdMS_TO_TICKS(POWER_SILENCE_SLEEP_MS));
+  i2s_start(I2S_PORT);
+#if I2S_USE_EVENT_QUEUE
+  resetI2SEvents();
+#endif
+#endif
+}
+#endif
+
+// Makes 'config' current and carves the detector's buffers for it
+const char *allocateAnalysis(const AnalysisConfig &config)
+{
+  const char *error = dspConfigure(config);
+  if (error != NULL)
+    return error;
+
+  vReal = arenaAllocate<float>(config.samples);
+  vImag = arenaAllocate<float>(config.samples);
+  i2sBuffer = arenaAllocate<i2s_sample_t>(config.samples);
+  bool allocated = vReal != NULL && vImag != NULL && i2sBuffer != NULL;
+#if CAPTURE_PIPELINE
+  for (CaptureFrame &frame : captureFrames)
+  {
+    frame.samples = arenaAllocate<float>(config.samples);
+    allocated = allocated && frame.samples != NULL;
   }
+#endif
+  return allocated ? NULL : "analysis arena too small";
+}
 
-  return frequencyToNote(peakFrequency);
+void printAnalysisConfig()
+{
+  char line[128];
+  formatAnalysisConfig(analysisConfig, line, sizeof(line));
+  Serial.printf("Analysis: %s\r\n", line);
+  Serial.printf("  FFT resolution: %.1f Hz per bin, stages:", (float)analysisConfig.samplingFrequency / analysisConfig.samples);
+  for (size_t stage = 0; stage < analysisStageCount; stage++)
+    Serial.printf(" %d", analysisStages[stage]);
+  Serial.printf(" samples, arena %u of %u bytes\r\n", (unsigned int)analysisArena.used, (unsigned int)analysisArena.size);
 }
 
-// Calculate RMS level for volume indication - CHANGED TO FLOAT
-float calculateRMS()
-{                   // Return type changed to float
-  float sum = 0.0f; // CHANGED TO FLOAT
-  for (int i = 0; i < SAMPLES; i++)
+// Switches the analysis to 'config' between two frames; call from the loop()
+// task. Returns NULL, or the reason and keeps the current configuration.
+const char *reconfigureAnalysis(const AnalysisConfig &config)
+{
+  const char *error = validateAnalysisConfig(config);
+  if (error != NULL)
+    return error;
+#if CAPTURE_PIPELINE
+  if (config.engine != ENGINE_FIXED)
+    return "the capture pipeline needs engine=fixed";
+  pausePipeline();
+#endif
+
+  bool rateChanged = config.samplingFrequency != analysisConfig.samplingFrequency;
+  error = allocateAnalysis(config);
+  if (error == NULL && rateChanged)
   {
-    sum += vReal[i] * vReal[i];
+    esp_err_t result = i2s_set_sample_rates(I2S_PORT, config.samplingFrequency);
+    if (result != ESP_OK)
+      LOG_ERROR("i2s_set_sample_rates(%d) failed: %d", config.samplingFrequency, (int)result);
   }
-  // This function should be called *before* complexToMagnitude
-  // For demonstration, assuming vReal holds time-domain data.
-  // In your loop(), ensure it's called at the right place.
-  return sqrtf(sum / SAMPLES); // Use sqrtf for float
+  highPassState = {0.0f, 0.0f};
+#if I2S_USE_EVENT_QUEUE
+  resetI2SEvents();
+#endif
+  resetI2SStats();
+
+#if CAPTURE_PIPELINE
+  // Frames captured before the change have the old length
+  for (CaptureFrame &frame : captureFrames)
+    frame.state.store(FRAME_FREE);
+  resumePipeline();
+#endif
+  return error;
 }
 
 void detect_setup()
 {
+  powerSetup();
+
+  if (!arenaSetup(DETECT_ARENA_BYTES))
+    Serial.printf("Cannot allocate the %u byte analysis arena\r\n", (unsigned int)DETECT_ARENA_BYTES);
+  const char *error = allocateAnalysis(defaultAnalysisConfig);
+  if (error != NULL)
+    Serial.printf("Analysis configuration failed: %s\r\n", error);
+
   // Initialize I2S
   initI2S();
 
-  Serial.println("Sample Rate: " + String(SAMPLING_FREQUENCY) + " Hz");
-  Serial.println("FFT Resolution: " + String((float)SAMPLING_FREQUENCY / SAMPLES, 1) + " Hz per bin");
-  Serial.println("Max detectable frequency: " + String(SAMPLING_FREQUENCY / 2) + " Hz");
+  printAnalysisConfig();
+  Serial.println("Max detectable frequency: " + String(analysisConfig.samplingFrequency / 2) + " Hz");
+#if CAPTURE_PIPELINE
+  setupPipeline();
+  Serial.printf("Capture pipeline: capture on core %d, analysis on core %d\r\n", CAPTURE_TASK_CORE, analysisCore);
+#endif
 }
 
 // Returns 0.0 is no note was detected, frequency otherwise
 float detect_loop()
 {
-  // Read samples from I2S microphone (moved here for RMS)
-  if (!readI2SSamples())
+  float noteFrequency = 0.0;
+  float rmsLevel = 0.0;
+  int samplesRead = 0;
+  int samples = 0;
+  unsigned long startTime = 0;
+  uint32_t processingUs = 0;
+  int64_t stageStart = 0;
+
+#if CAPTURE_PIPELINE
+  CaptureFrame *frame = takeCaptureFrame();
+  int64_t busyStart = esp_timer_get_time();
+  startTime = millis();
+  recordI2SDelay(frame->bufferUs, busyStart);
+  detectCaptureUs = frame->bufferUs;
+
+  powerBeginDsp();
+  samples = analysisConfig.samples;
+  rmsLevel = frame->rms;
+  noteFrequency = analyseSpectrum(frame->samples, vImag, samples);
+  powerEndDsp();
+  releaseCaptureFrame(frame, busyStart);
+  processingUs = (uint32_t)(esp_timer_get_time() - busyStart);
+#else
+  sleepDuringSilence();
+
+  for (size_t stage = 0; stage < analysisStageCount; stage++)
   {
-    Serial.println("I2S Read Error"); // Print error here, return implicitly
-    delay(200);
-    return(0.0); // Exit loop iteration if read fails
-  }
-
-  unsigned long startTime = millis();
-
-  // Convert I2S samples to float array
-  convertI2SToFloat();
-
-  // Apply high-pass filter to remove DC offset
-  applyHighPassFilter();
-
-  // Calculate volume level BEFORE FFT processing that changes vReal
-  float rmsLevel = calculateRMS();                         // CHANGED TO FLOAT return type
-  
-  // Serial.print("Raw RMS: ");
-  // Serial.println(rmsLevel, 6); // Print with high precision
-  
-  // Apply scale factor; tune for your volume...
-  int volumePercent = min(100, (int)(rmsLevel * 150000.0f)); 
-
-  // Now proceed with FFT for note detection
-  // Apply window function to reduce spectral leakage
-  FFT.windowing(vReal, SAMPLES, FFT_WIN_TYP_HAMMING, FFT_FORWARD);
+    samples = analysisStages[stage];
 
-  // Compute FFT
-  FFT.compute(vReal, vImag, SAMPLES, FFT_FORWARD);
-
-  // Compute magnitudes
-  FFT.complexToMagnitude(vReal, vImag, SAMPLES);
+    // Extend the frame with the samples this stage needs on top of the previous one
+    PROFILE_BEGIN(PROFILE_I2S_WAIT);
+    bool captured = readI2SSamples(samplesRead, samples - samplesRead);
+    PROFILE_END(PROFILE_I2S_WAIT);
+    if (!captured)
+    {
+      LOG_ERROR("I2S Read Error"); // Print error here, return implicitly
+      delay(200);
+      return (0.0); // Exit loop iteration if read fails
+    }
+    samplesRead = samples;
 
-  // Find peak frequency (ignore DC component and very low frequencies)
-  float maxMagnitude = 0; // CHANGED TO FLOAT
-  int peakIndex = 0;
+    startTime = millis();
+    detectCaptureUs = i2sStats.lastBufferUs;
 
-  // Focus on musical range (80Hz to 5kHz)
-  int minIndex = max(1, (int)((80.0f * SAMPLES) / SAMPLING_FREQUENCY));
-  int maxIndex = min(SAMPLES / 2, (int)((5000.0f * SAMPLES) / SAMPLING_FREQUENCY));
+    // Every stage filters the frame from its start, so restart from the saved state
+    stageStart = esp_timer_get_time();
+    powerBeginDsp();
+    HighPassState state = highPassState;
+    noteFrequency = analyseWindow(i2sBuffer, vReal, vImag, samples, state, rmsLevel);
+    powerEndDsp();
+    processingUs += (uint32_t)(esp_timer_get_time() - stageStart);
 
-  for (int i = minIndex; i < maxIndex; i++)
-  {
-    if (vReal[i] > maxMagnitude)
+    if (analysisStageDone(stage, noteFrequency, samples))
     {
-      maxMagnitude = vReal[i];
-      peakIndex = i;
+      highPassState = state;
+      break;
     }
   }
+  // The stage that committed the frame is the one whose delay counts
+  recordI2SDelay(detectCaptureUs, stageStart);
+#endif
 
-  float noteFrequency = 0.0;
+  powerFrameDone(noteFrequency > 0.0f, (uint32_t)(1000000ULL * samples / analysisConfig.samplingFrequency), processingUs);
 
-  // Check if we found a significant peak
-  if (maxMagnitude < 0.2f)
-  { // Adjust threshold based on your environment
-    // Serial.printf("maxMagnitude(2): %f\r\n", maxMagnitude);
-    // Serial.print("Note: No Clear Note");
-  }
-  else
-  {
-    // Calculate frequency from peak index
-    float peakFrequency = ((float)peakIndex * SAMPLING_FREQUENCY) / SAMPLES;
+  // Serial.print("Raw RMS: ");
+  // Serial.println(rmsLevel, 6); // Print with high precision
 
-    // Apply quadratic interpolation for better frequency resolution
-    if (peakIndex > minIndex && peakIndex < maxIndex - 1)
-    {
-      float y1 = vReal[peakIndex - 1];
-      float y2 = vReal[peakIndex];
-      float y3 = vReal[peakIndex + 1];
-
-      float a = (y1 - 2.0f * y2 + y3) / 2.0f;
-      float b = (y3 - y1) / 2.0f;
-
-      if (a != 0.0f)
-      {
-        float peakOffset = -b / (2.0f * a);
-        peakFrequency = ((float)(peakIndex + peakOffset) * SAMPLING_FREQUENCY) / SAMPLES;
-      }
-    }
+  detectLevel = rmsToLevel(rmsLevel);
 
+  if (noteFrequency > 0.0f)
+  {
     unsigned long endTime = millis();
+    PROFILE_BEGIN(PROFILE_QUANTIZATION);
+    QuantizedNote note = quantizeFrequency(noteFrequency);
+    PROFILE_END(PROFILE_QUANTIZATION);
 
-    Serial.print("Note: ");
-    Serial.print(frequencyToNote(peakFrequency));
-    Serial.print(" v:");
-    Serial.print(rmsLevel, 6);
-    Serial.print(" t:");
-    Serial.print(endTime-startTime, 6);
-    Serial.println();
-
-    noteFrequency = peakFrequency;
+    LOG_INFO("Note: %s%d %+d (%.1f Hz) v:%.6f n:%d t:%lu", note.name, note.octave, note.cents,
+             noteFrequency, rmsLevel, samples, endTime - startTime);
   }
   return noteFrequency;
-}
\ No newline at end of file
+}
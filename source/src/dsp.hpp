@@ -0,0 +1,482 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <arduinoFFT.h>
+
+// The signal-processing kernels of the detector. Nothing here touches the
+// Arduino core, the I2S driver or FreeRTOS, so the same code builds on the host
+// for benchmarks and replay (see source/host).
+
+// Capture sample width: 32 (24-bit data in 32-bit slots) or 16 (packed, half
+// the DMA memory and copy bandwidth, top 16 bits of the microphone data only)
+#define I2S_SAMPLE_BITS 32
+
+// FFT configuration at boot; analysisConfig holds the values in use
+#define SAMPLES 512
+#define SAMPLING_FREQUENCY 16000 // 16kHz sampling rate
+
+// Peak magnitude needed for a note at SAMPLES points; scaled for other windows
+#define PEAK_THRESHOLD 0.2f
+
+// Frame RMS that counts as full level (1.0), in units of the converted samples:
+// the INMP441 reads -26 dBFS, an RMS of 0.035, for a 94 dB SPL tone. The
+// quietest notes PEAK_THRESHOLD lets through have an RMS of about 0.0011,
+// 30 dB below, so the notes played span most of a 40 dB dynamics range.
+#define LEVEL_FULL_SCALE_RMS 0.035f
+
+// Musical range searched for the peak
+#define PEAK_MIN_FREQUENCY 80.0f
+#define PEAK_MAX_FREQUENCY 5000.0f
+
+// Adaptive FFT size: analyse a short window first and only wait for more
+// samples when its resolution cannot separate semitones at the detected pitch.
+// With 512 samples, high notes commit after 128 (8 ms), mid notes after 256.
+#define ADAPTIVE_FFT 1
+
+// Limits for reconfiguration at runtime. The working buffers come from one
+// arena sized for ANALYSIS_MAX_SAMPLES at boot and carved again on every
+// change, so switching never touches the heap. Host tools may raise the
+// maximum before including this file.
+#define ANALYSIS_MIN_SAMPLES 64
+#ifndef ANALYSIS_MAX_SAMPLES
+#define ANALYSIS_MAX_SAMPLES 2048
+#endif
+#define ANALYSIS_MIN_RATE 8000
+#define ANALYSIS_MAX_RATE 48000
+#define ANALYSIS_MAX_STAGES 3
+
+// A stage commits when one semitone at the pitch spans at least this many bins
+#define ADAPTIVE_BINS_PER_SEMITONE 1.0f
+
+// Frequency ratio between two adjacent semitones minus one (2^(1/12) - 1)
+#define SEMITONE_STEP 0.0594630944f
+
+// Opt-in placement profile, enabled by the esp32dev_iram environment: the hot
+// kernels run from IRAM and the arena holding their tables and buffers comes
+// from internal DRAM, never PSRAM, so BLE and WiFi traffic evicting the shared
+// flash cache cannot stretch a frame. arduinoFFT follows through FFT_IRAM_ATTR,
+// set by the same environment.
+#ifndef DSP_PLACEMENT
+#define DSP_PLACEMENT 0
+#endif
+
+#if DSP_PLACEMENT && defined(ESP32)
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+#define DSP_IRAM IRAM_ATTR
+#else
+#define DSP_IRAM
+#endif
+
+// Stage probes are no-ops unless profile.hpp was included first
+#ifndef PROFILE_BEGIN
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(stage)
+#endif
+
+#if I2S_SAMPLE_BITS == 16
+typedef int16_t i2s_sample_t;
+#define I2S_SAMPLE_SCALE 32768.0f // 2^15 for 16-bit signed
+#else
+typedef int32_t i2s_sample_t;
+#define I2S_SAMPLE_SCALE 8388608.0f // 2^23 for 24-bit signed
+#endif
+
+// Create FFT object - CHANGED TO FLOAT
+ArduinoFFT<float> FFT = ArduinoFFT<float>();
+
+enum AnalysisEngine : uint8_t
+{
+  ENGINE_FIXED,   // One FFT over the whole frame
+  ENGINE_ADAPTIVE // Quarter, half and whole frame, see ADAPTIVE_FFT
+};
+
+struct AnalysisConfig
+{
+  int samples;           // Frame length, a power of two
+  int samplingFrequency; // Hz
+  FFTWindow window;
+  float peakThreshold; // Peak magnitude for a note at SAMPLES points
+  float minFrequency;  // Peak search range in Hz
+  float maxFrequency;
+  AnalysisEngine engine;
+};
+
+const AnalysisConfig defaultAnalysisConfig = {
+    SAMPLES, SAMPLING_FREQUENCY, FFT_WIN_TYP_HAMMING, PEAK_THRESHOLD,
+    PEAK_MIN_FREQUENCY, PEAK_MAX_FREQUENCY, ADAPTIVE_FFT ? ENGINE_ADAPTIVE : ENGINE_FIXED};
+
+AnalysisConfig analysisConfig = defaultAnalysisConfig;
+
+// Window lengths the engine analyses, shortest first; set by dspConfigure()
+int analysisStages[ANALYSIS_MAX_STAGES];
+size_t analysisStageCount = 0;
+
+const char *const windowNames[] = {"rectangle", "hamming", "hann", "triangle", "nuttall",
+                                   "blackman", "blackman_nuttall", "blackman_harris", "flat_top", "welch"};
+#define WINDOW_COUNT (sizeof(windowNames) / sizeof(windowNames[0]))
+
+const char *const engineNames[] = {"fixed", "adaptive"};
+
+// Bump allocator over one block allocated at boot; arenaReset() frees
+// everything at once
+struct Arena
+{
+  uint8_t *base;
+  size_t size;
+  size_t used;
+};
+
+static Arena analysisArena = {NULL, 0, 0};
+
+// Bytes dspConfigure() carves for a frame of 'samples'
+#define DSP_ARENA_BYTES(samples) ((samples) * sizeof(float) + 16)
+
+bool arenaSetup(size_t size)
+{
+#if DSP_PLACEMENT && defined(ESP32)
+  analysisArena.base = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+#else
+  analysisArena.base = (uint8_t *)malloc(size);
+#endif
+  analysisArena.size = analysisArena.base != NULL ? size : 0;
+  analysisArena.used = 0;
+  return analysisArena.base != NULL;
+}
+
+void arenaReset()
+{
+  analysisArena.used = 0;
+}
+
+// 16-byte aligned room for 'count' values, NULL when the arena is exhausted
+template <typename T>
+T *arenaAllocate(size_t count)
+{
+  size_t start = (analysisArena.used + 15) & ~(size_t)15;
+  if (analysisArena.base == NULL || start + count * sizeof(T) > analysisArena.size)
+    return NULL;
+  analysisArena.used = start + count * sizeof(T);
+  return (T *)(analysisArena.base + start);
+}
+
+// Weights of the configured window for every stage, computed by the first frame
+// of each length so windowing does not evaluate cos() per sample afterwards.
+// The window is symmetric, so 'samples' points need samples / 2 weights, found
+// at offset samples / 2 - 1.
+static float *windowFactors = NULL;
+static uint32_t windowFactorsReady = 0; // Bit n set once the 2^n table is filled
+
+void DSP_IRAM applyWindow(float *data, int samples)
+{
+  float *factors = &windowFactors[samples / 2 - 1];
+  uint32_t bit = 1u << __builtin_ctz(samples);
+  if (windowFactorsReady & bit)
+  {
+    FFT.windowing(data, samples, FFTWindow::Precompiled, FFT_FORWARD, factors);
+  }
+  else
+  {
+    FFT.windowing(data, samples, analysisConfig.window, FFT_FORWARD, factors);
+    windowFactorsReady |= bit;
+  }
+}
+
+// NULL if 'config' can be applied, otherwise the reason it cannot
+const char *validateAnalysisConfig(const AnalysisConfig &config)
+{
+  if (config.samples < ANALYSIS_MIN_SAMPLES || config.samples > ANALYSIS_MAX_SAMPLES ||
+      (config.samples & (config.samples - 1)) != 0)
+    return "samples must be a power of two within the analysis limits";
+  if (config.samplingFrequency < ANALYSIS_MIN_RATE || config.samplingFrequency > ANALYSIS_MAX_RATE)
+    return "rate outside the analysis limits";
+  if ((size_t)config.window >= WINDOW_COUNT)
+    return "unknown window";
+  if (!(config.peakThreshold > 0.0f))
+    return "threshold must be positive";
+  if (!(config.minFrequency > 0.0f && config.minFrequency < config.maxFrequency &&
+        config.maxFrequency <= config.samplingFrequency / 2.0f))
+    return "need 0 < min < max <= rate / 2";
+  return NULL;
+}
+
+// Makes 'config' current: resets the arena, carves the kernel tables and sets
+// up the stages. Callers carve their own buffers from the arena afterwards.
+// Returns NULL, or the reason and leaves the configuration unchanged.
+const char *dspConfigure(const AnalysisConfig &config)
+{
+  const char *error = validateAnalysisConfig(config);
+  if (error != NULL)
+    return error;
+  if (analysisArena.size < DSP_ARENA_BYTES(config.samples))
+    return "analysis arena too small";
+
+  arenaReset();
+  windowFactors = arenaAllocate<float>(config.samples);
+  windowFactorsReady = 0;
+
+  analysisStageCount = 0;
+  if (config.engine == ENGINE_ADAPTIVE)
+  {
+    for (int samples = config.samples / 4; samples < config.samples; samples *= 2)
+    {
+      if (samples >= ANALYSIS_MIN_SAMPLES)
+        analysisStages[analysisStageCount++] = samples;
+    }
+  }
+  analysisStages[analysisStageCount++] = config.samples;
+
+  analysisConfig = config;
+  return NULL;
+}
+
+static int findName(const char *name, const char *const *names, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    if (strcmp(name, names[i]) == 0)
+      return (int)i;
+  }
+  return -1;
+}
+
+// Applies "key=value" settings from 'line' to 'config': samples, rate, window,
+// threshold, min, max and engine. Returns NULL, or the first setting it could
+// not parse; 'config' is only meaningful on success.
+const char *parseAnalysisConfig(const char *line, AnalysisConfig &config)
+{
+  static char error[48];
+  char buffer[128];
+  strncpy(buffer, line, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = '\0';
+
+  char *save = NULL;
+  for (char *token = strtok_r(buffer, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save))
+  {
+    char *value = strchr(token, '=');
+    char *end = NULL;
+    bool ok = value != NULL;
+    if (ok)
+    {
+      *value++ = '\0';
+      if (strcmp(token, "samples") == 0)
+        config.samples = (int)strtol(value, &end, 10);
+      else if (strcmp(token, "rate") == 0)
+        config.samplingFrequency = (int)strtol(value, &end, 10);
+      else if (strcmp(token, "threshold") == 0)
+        config.peakThreshold = strtof(value, &end);
+      else if (strcmp(token, "min") == 0)
+        config.minFrequency = strtof(value, &end);
+      else if (strcmp(token, "max") == 0)
+        config.maxFrequency = strtof(value, &end);
+      else if (strcmp(token, "window") == 0)
+      {
+        int index = findName(value, windowNames, WINDOW_COUNT);
+        config.window = (FFTWindow)index;
+        ok = index >= 0;
+      }
+      else if (strcmp(token, "engine") == 0)
+      {
+        int index = findName(value, engineNames, 2);
+        config.engine = (AnalysisEngine)index;
+        ok = index >= 0;
+      }
+      else
+        ok = false;
+      if (end != NULL)
+        ok = end != value && *end == '\0';
+    }
+    if (!ok)
+    {
+      snprintf(error, sizeof(error), "cannot parse '%s'", token);
+      return error;
+    }
+  }
+  return NULL;
+}
+
+// Writes 'config' in the form parseAnalysisConfig() reads
+void formatAnalysisConfig(const AnalysisConfig &config, char *line, size_t size)
+{
+  snprintf(line, size, "samples=%d rate=%d window=%s threshold=%.3f min=%.0f max=%.0f engine=%s",
+           config.samples, config.samplingFrequency, windowNames[(size_t)config.window], config.peakThreshold,
+           config.minFrequency, config.maxFrequency, engineNames[config.engine]);
+}
+
+// State of the DC-removal high-pass filter, carried from frame to frame
+struct HighPassState
+{
+  float previousSample;
+  float previousOutput;
+};
+
+// Convert the first 'samples' I2S samples to normalized float values
+void DSP_IRAM convertI2SToFloat(const i2s_sample_t *source, float *destination, int samples)
+{
+  for (int i = 0; i < samples; i++)
+  {
+#if I2S_SAMPLE_BITS == 16
+    // In 16-bit mono mode the ESP32 stores each pair of samples swapped
+    // within its 32-bit word, so undo that while converting
+    int32_t sample = source[i ^ 1];
+#else
+    // INMP441 provides 24-bit data in upper 24 bits of 32-bit word
+    // Right-shift by 8 to get 24-bit signed value
+    int32_t sample = source[i] >> 8;
+#endif
+
+    // Normalize to range [-1.0, 1.0]
+    destination[i] = (float)sample / I2S_SAMPLE_SCALE;
+  }
+}
+
+// Apply simple high-pass filter to remove DC offset, starting from 'state'
+float DSP_IRAM applyHighPassFilter(float *data, int samples, HighPassState &state)
+{
+  const float alpha = 0.95f; // High-pass filter coefficient - CHANGED TO FLOAT
+  float peak = 0.0;
+
+  for (int i = 0; i < samples; i++)
+  {
+    float currentSample = data[i];
+    if (currentSample > peak)
+      peak = currentSample;
+    float output = alpha * (state.previousOutput + currentSample - state.previousSample);
+    state.previousOutput = output;
+    state.previousSample = currentSample;
+    data[i] = output;
+  }
+  return peak;
+}
+
+// Calculate RMS level for volume indication - CHANGED TO FLOAT
+float DSP_IRAM calculateRMS(const float *data, int samples)
+{
+  float sum = 0.0f;
+  for (int i = 0; i < samples; i++)
+  {
+    sum += data[i] * data[i];
+  }
+  // This function should be called *before* complexToMagnitude
+  // For demonstration, assuming vReal holds time-domain data.
+  // In your loop(), ensure it's called at the right place.
+  return sqrtf(sum / samples); // Use sqrtf for float
+}
+
+// 0..1 loudness for a frame RMS from calculateRMS(), see LEVEL_FULL_SCALE_RMS
+inline float rmsToLevel(float rms)
+{
+  return rms < LEVEL_FULL_SCALE_RMS ? rms / LEVEL_FULL_SCALE_RMS : 1.0f;
+}
+
+// Runs the FFT peak search over 'samples' filtered time-domain values in
+// 'data', which is overwritten with the magnitude spectrum; 'imag' is scratch.
+// Returns 0.0 if no clear peak was found, the interpolated frequency otherwise.
+float DSP_IRAM analyseSpectrum(float *data, float *imag, int samples)
+{
+  // Clear imaginary part
+  memset(imag, 0, samples * sizeof(imag[0]));
+
+  // Apply window function to reduce spectral leakage
+  PROFILE_BEGIN(PROFILE_WINDOWING);
+  applyWindow(data, samples);
+  PROFILE_END(PROFILE_WINDOWING);
+
+  // Compute FFT
+  PROFILE_BEGIN(PROFILE_FFT);
+  FFT.compute(data, imag, samples, FFT_FORWARD);
+  PROFILE_END(PROFILE_FFT);
+
+  // Compute magnitudes
+  PROFILE_BEGIN(PROFILE_MAGNITUDE);
+  FFT.complexToMagnitude(data, imag, samples);
+  PROFILE_END(PROFILE_MAGNITUDE);
+
+  // Find peak frequency (ignore DC component and very low frequencies)
+  PROFILE_BEGIN(PROFILE_PEAK_SEARCH);
+  float maxMagnitude = 0;
+  int peakIndex = 0;
+
+  // Focus on musical range (80Hz to 5kHz by default)
+  const AnalysisConfig &config = analysisConfig;
+  int minIndex = std::max(1, (int)((config.minFrequency * samples) / config.samplingFrequency));
+  int maxIndex = std::min(samples / 2, (int)((config.maxFrequency * samples) / config.samplingFrequency));
+
+  for (int i = minIndex; i < maxIndex; i++)
+  {
+    if (data[i] > maxMagnitude)
+    {
+      maxMagnitude = data[i];
+      peakIndex = i;
+    }
+  }
+  PROFILE_END(PROFILE_PEAK_SEARCH);
+
+  // Check if we found a significant peak; magnitudes grow with the window length
+  if (maxMagnitude < config.peakThreshold * samples / SAMPLES)
+  {
+    return 0.0f;
+  }
+
+  // Calculate frequency from peak index
+  float peakFrequency = ((float)peakIndex * config.samplingFrequency) / samples;
+
+  // Apply quadratic interpolation for better frequency resolution
+  if (peakIndex > minIndex && peakIndex < maxIndex - 1)
+  {
+    float y1 = data[peakIndex - 1];
+    float y2 = data[peakIndex];
+    float y3 = data[peakIndex + 1];
+
+    float a = (y1 - 2.0f * y2 + y3) / 2.0f;
+    float b = (y3 - y1) / 2.0f;
+
+    if (a != 0.0f)
+    {
+      float peakOffset = -b / (2.0f * a);
+      peakFrequency = ((float)(peakIndex + peakOffset) * config.samplingFrequency) / samples;
+    }
+  }
+
+  return peakFrequency;
+}
+
+// True when a window of 'samples' points already separates semitones at 'frequency'
+bool resolvesSemitone(float frequency, int samples)
+{
+  float binWidth = (float)analysisConfig.samplingFrequency / samples;
+  return frequency * SEMITONE_STEP >= ADAPTIVE_BINS_PER_SEMITONE * binWidth;
+}
+
+// Runs the analysis over the first 'samples' entries of 'source', using 'real'
+// and 'imag' as working buffers
+float DSP_IRAM analyseWindow(const i2s_sample_t *source, float *real, float *imag, int samples, HighPassState &state,
+                    float &rmsLevel)
+{
+  // Convert I2S samples to float array
+  PROFILE_BEGIN(PROFILE_CONVERSION);
+  convertI2SToFloat(source, real, samples);
+  PROFILE_END(PROFILE_CONVERSION);
+
+  // Apply high-pass filter to remove DC offset
+  PROFILE_BEGIN(PROFILE_HIGH_PASS);
+  applyHighPassFilter(real, samples, state);
+  PROFILE_END(PROFILE_HIGH_PASS);
+
+  // Calculate volume level BEFORE FFT processing that changes 'real'
+  PROFILE_BEGIN(PROFILE_RMS);
+  rmsLevel = calculateRMS(real, samples);
+  PROFILE_END(PROFILE_RMS);
+
+  return analyseSpectrum(real, imag, samples);
+}
+
+// True when the analysis of a frame can stop at 'stage', which found 'frequency'
+// in 'samples' points: the last stage, or a note the window already resolves
+bool analysisStageDone(size_t stage, float frequency, int samples)
+{
+  return stage == analysisStageCount - 1 || (frequency > 0.0f && resolvesSemitone(frequency, samples));
+}
@@ -0,0 +1,248 @@
+#include <Arduino.h>
+#include <atomic>
+
+// Asynchronous logging: callers store the format pointer and raw arguments in
+// a lock-free ring buffer, and a low-priority task formats and prints them, so
+// a full UART never stalls the audio path. Formats and string arguments must
+// be in static storage (string literals, noteNames).
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// Calls above this level are removed at compile time, arguments included
+#define LOG_LEVEL LOG_LEVEL_INFO
+
+#define LOG_RING_SIZE 64 // Records, must be a power of two
+#define LOG_MAX_ARGS 8
+#define LOG_TASK_CORE 0
+#define LOG_TASK_PRIORITY 1
+#define LOG_DRAIN_INTERVAL_MS 10
+
+union LogValue
+{
+  int32_t i;
+  uint32_t u;
+  float f;
+  const char *s;
+};
+
+struct LogRecord
+{
+  std::atomic<uint32_t> sequence; // Slot turn, see logWrite()
+  uint32_t timestampMs;
+  const char *format;
+  uint8_t level;
+  uint8_t count;
+  char types[LOG_MAX_ARGS]; // 'i', 'u', 'f' or 's' per argument
+  LogValue values[LOG_MAX_ARGS];
+};
+
+static LogRecord logRing[LOG_RING_SIZE];
+static std::atomic<uint32_t> logEnqueuePosition(0);
+static uint32_t logDequeuePosition = 0;
+static std::atomic<uint32_t> logDropped(0);
+
+inline void logStore(LogRecord &record, int value)
+{
+  record.types[record.count] = 'i';
+  record.values[record.count++].i = value;
+}
+
+inline void logStore(LogRecord &record, unsigned int value)
+{
+  record.types[record.count] = 'u';
+  record.values[record.count++].u = value;
+}
+
+inline void logStore(LogRecord &record, long value) { logStore(record, (int)value); }
+inline void logStore(LogRecord &record, unsigned long value) { logStore(record, (unsigned int)value); }
+
+inline void logStore(LogRecord &record, float value)
+{
+  record.types[record.count] = 'f';
+  record.values[record.count++].f = value;
+}
+
+inline void logStore(LogRecord &record, double value) { logStore(record, (float)value); }
+
+inline void logStore(LogRecord &record, const char *value)
+{
+  record.types[record.count] = 's';
+  record.values[record.count++].s = value;
+}
+
+// Multi-producer enqueue (bounded MPMC queue after D. Vyukov): a slot is free
+// for position p when its sequence equals p and holds a record once it is p + 1.
+// Never blocks; when the ring is full the record is counted as dropped.
+template <typename... Args>
+void logWrite(uint8_t level, const char *format, Args... args)
+{
+  static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+
+  uint32_t position = logEnqueuePosition.load(std::memory_order_relaxed);
+  LogRecord *record;
+  for (;;)
+  {
+    record = &logRing[position & (LOG_RING_SIZE - 1)];
+    int32_t difference = (int32_t)(record->sequence.load(std::memory_order_acquire) - position);
+    if (difference == 0)
+    {
+      if (logEnqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (difference < 0)
+    {
+      logDropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    else
+    {
+      position = logEnqueuePosition.load(std::memory_order_relaxed);
+    }
+  }
+
+  record->timestampMs = millis();
+  record->format = format;
+  record->level = level;
+  record->count = 0;
+  (logStore(*record, args), ...);
+  record->sequence.store(position + 1, std::memory_order_release);
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logWrite(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logWrite(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logWrite(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logWrite(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+// Expand one record's format with its stored arguments into 'line'
+void logFormat(const LogRecord &record, char *line, size_t size)
+{
+  const char *levelTags[] = {"", "E ", "W ", "", "D "};
+  size_t length = snprintf(line, size, "[%u] %s", (unsigned int)record.timestampMs, levelTags[record.level]);
+  uint8_t argument = 0;
+
+  for (const char *p = record.format; *p != '\0' && length < size - 1; p++)
+  {
+    if (*p != '%')
+    {
+      line[length++] = *p;
+      continue;
+    }
+    if (p[1] == '%')
+    {
+      line[length++] = '%';
+      p++;
+      continue;
+    }
+
+    // Copy flags, width and precision; drop length modifiers, values are 32 bit
+    char spec[16];
+    size_t specLength = 0;
+    spec[specLength++] = *p++;
+    while (*p != '\0' && strchr("-+ #0123456789.lhzjt", *p) != NULL && specLength < sizeof(spec) - 2)
+    {
+      if (strchr("lhzjt", *p) == NULL)
+        spec[specLength++] = *p;
+      p++;
+    }
+    if (*p == '\0' || argument >= record.count)
+      break;
+    spec[specLength++] = *p;
+    spec[specLength] = '\0';
+
+    const LogValue &value = record.values[argument];
+    switch (record.types[argument++])
+    {
+    case 'i':
+      length += snprintf(line + length, size - length, spec, (int)value.i);
+      break;
+    case 'u':
+      length += snprintf(line + length, size - length, spec, (unsigned int)value.u);
+      break;
+    case 'f':
+      length += snprintf(line + length, size - length, spec, (double)value.f);
+      break;
+    case 's':
+      length += snprintf(line + length, size - length, spec, value.s);
+      break;
+    }
+  }
+  if (length > size - 1)
+    length = size - 1;
+  line[length] = '\0';
+}
+
+// Single consumer: takes the next record if it is complete
+bool logRead(LogRecord &out)
+{
+  LogRecord &record = logRing[logDequeuePosition & (LOG_RING_SIZE - 1)];
+  if (record.sequence.load(std::memory_order_acquire) != logDequeuePosition + 1)
+    return false;
+
+  out.timestampMs = record.timestampMs;
+  out.format = record.format;
+  out.level = record.level;
+  out.count = record.count;
+  memcpy(out.types, record.types, sizeof(out.types));
+  memcpy(out.values, record.values, sizeof(out.values));
+  record.sequence.store(logDequeuePosition + LOG_RING_SIZE, std::memory_order_release);
+  logDequeuePosition++;
+  return true;
+}
+
+void logTaskMain(void *parameter)
+{
+  LogRecord record;
+  char line[160];
+  uint32_t reportedDropped = 0;
+
+  for (;;)
+  {
+    while (logRead(record))
+    {
+      logFormat(record, line, sizeof(line));
+      Serial.println(line);
+    }
+
+    uint32_t dropped = logDropped.load(std::memory_order_relaxed);
+    if (dropped != reportedDropped)
+    {
+      Serial.printf("[log] %u records dropped\r\n", (unsigned int)(dropped - reportedDropped));
+      reportedDropped = dropped;
+    }
+    vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_INTERVAL_MS));
+  }
+}
+
+void logSetup()
+{
+  for (uint32_t i = 0; i < LOG_RING_SIZE; i++)
+    logRing[i].sequence.store(i, std::memory_order_relaxed);
+  xTaskCreatePinnedToCore(logTaskMain, "log", 4096, NULL, LOG_TASK_PRIORITY, NULL, LOG_TASK_CORE);
+}
+
+uint32_t logDroppedCount()
+{
+  return logDropped.load(std::memory_order_relaxed);
+}
@@ -6,8 +6,9 @@
 #include <FS.h>
 #include <BLEMidi.h>
 
-#include "commander.hpp"
 #include "detect.hpp"
+#include "midiout.hpp"
+#include "commander.hpp"
 #include "midinotes.h"
 
 #define KEY1 32
@@ -61,13 +62,14 @@ void selectProgram(int channel, int program)
   // Note: GM programs are numbered 1-128, but MIDI uses 0-127
   // Serial.write(0xC0 + (channel - 1));  // Program Change on specified channel
   // Serial.write(program - 1);           // Program number (GM 48 becomes 47)
-  BLEMidiServer.programChange(channel, program - 1);
+  midiProgramChange(channel, program - 1);
 }
 
 void setup()
 {
   Serial.begin(921600);
   delay(100);
+  logSetup();
 
   pinMode(LED, OUTPUT);
   pinMode(KEY1, INPUT_PULLUP);
@@ -78,6 +80,7 @@ void setup()
 
   Serial.println("Initializing bluetooth");
   BLEMidiServer.begin("MIDI one-note device");
+  midiOutSetup();
 
   // Get and print the BLE MAC address
   BLEAddress bleMac = BLEDevice::getAddress();
@@ -191,80 +194,72 @@ void checkSleep()
     digitalWrite(LED, false);
     delay(100);
 
+    // No note may hang on the synth while we sleep
+    midiAllNotesOff();
+    midiOutFlush();
+
     Serial.println("Going to sleep...");
-    delay(100); // Brief delay for serial output
+    delay(100); // Brief delay for serial and BLE output
     esp_deep_sleep_start();
   }
 }
 
-// Function to convert frequency (Hz) to MIDI note number
-static int freqToMidi(float frequency)
-{
-  // Validate input
-  if (frequency <= 0)
-  {
-    return -1; // Invalid frequency
-  }
-
-  // MIDI note 69 (A4) = 440 Hz (concert pitch)
-  // Formula: MIDI = 69 + 12 * log2(freq / 440)
-  // Using natural log: log2(x) = ln(x) / ln(2)
-
-  float midiNote = 69.0 + 12.0 * (log(frequency / 440.0) / log(2.0));
-
-  // Round to nearest integer
-  int roundedMidi = (int)(midiNote + 0.5);
-
-  // Validate MIDI range (0-127)
-  if (roundedMidi < 0 || roundedMidi > 127)
-  {
-    return -1; // Out of MIDI range
-  }
-
-  return roundedMidi;
-}
-
 static float noteFrequency = 0.0;
 static bool silenced = false;
 static int prevMidiNumber = -1;
 static bool bleInitialised = false;
 
-void playNote(float noteFrequency)
+// Sounds 'midiNumber' from the pitch tracker, -1 for silence; 'pitch' is the
+// fractional note glide mode bends towards, 'level' the loudness for dynamics.
+// The output layer in midiout.hpp drops anything the synth already knows.
+void playNote(int midiNumber, float pitch, float level)
 {
-  if (digitalRead(KEY2) == LOW)
+  // Releasing KEY2 ends the note like silence does
+  if (digitalRead(KEY2) != LOW)
+    midiNumber = -1;
+
+  if (midiNumber >= 0)
   {
-    if (noteFrequency > 0.0)
+    midiNumber = glideNote(midiNumber, prevMidiNumber, pitch);
+    // A note the table does not know as sounding was lost with the last connection
+    if ((midiNumber >= C5) && (midiNumber <= 127) &&
+        (prevMidiNumber != midiNumber || !midiNoteIsOn(MIDI_OUT_CHANNEL, midiNumber)))
     {
-      int midiNumber = freqToMidi(noteFrequency);
-      if ((midiNumber >= C5) && (midiNumber <= 127) && (prevMidiNumber != midiNumber))
+      if (BLEMidiServer.isConnected())
       {
-        if (BLEMidiServer.isConnected())
+        if (!bleInitialised)
         {
-          if (!bleInitialised)
-          {
-            bleInitialised = true;
-            selectProgram(0, GM_ROCK_ORGAN);
-            // Play opening note
-            BLEMidiServer.noteOn(0, MIDI_A4, 127);
-            delay(1000);
-            BLEMidiServer.noteOff(0, MIDI_A4, 127);
-          }
-
-          if (prevMidiNumber > 0)
-          {
-            BLEMidiServer.noteOff(0, prevMidiNumber, 127);
-          }
-          BLEMidiServer.noteOn(0, midiNumber, 127);
-          Serial.printf("Midi note: %d\r\n", midiNumber);
+          bleInitialised = true;
+          selectProgram(MIDI_OUT_CHANNEL, GM_ROCK_ORGAN);
+          // Play opening note
+          midiNoteOn(MIDI_OUT_CHANNEL, MIDI_A4, 127);
+          midiOutFlush();
+          delay(1000);
+          midiNoteOff(MIDI_OUT_CHANNEL, MIDI_A4, 127);
         }
-        prevMidiNumber = midiNumber;
+
+        midiNoteOff(MIDI_OUT_CHANNEL, prevMidiNumber, 127);
+        glideBend(midiNumber, pitch, millis(), true);
+        dynamicsUpdate(level, millis(), true);
+        midiNoteOn(MIDI_OUT_CHANNEL, midiNumber, noteVelocity(level));
+        LOG_INFO("Midi note: %d", midiNumber);
       }
+      prevMidiNumber = midiNumber;
     }
-    else
+    else if (midiNumber == prevMidiNumber && BLEMidiServer.isConnected())
     {
-      BLEMidiServer.noteOff(0, prevMidiNumber, 127);
+      glideBend(midiNumber, pitch, millis());
+      dynamicsUpdate(level, millis());
     }
   }
+  else if (prevMidiNumber >= 0)
+  {
+    midiNoteOff(MIDI_OUT_CHANNEL, prevMidiNumber, 127);
+    // Forget the note, so glide mode does not bend the next onset from it
+    prevMidiNumber = -1;
+    if (midiOutConfig.glide && BLEMidiServer.isConnected())
+      glideCentre(millis());
+  }
 }
 
 void loop()
@@ -272,7 +267,12 @@ void loop()
   checkSleep();
 
   noteFrequency = detect_loop();
-  playNote(noteFrequency);
+  midiOutUpdate();
+  int trackedNote = pitchTrackUpdate(noteFrequency, (uint32_t)detectCaptureUs);
+  // What the frame causes is stamped with when its sound was captured
+  midiOutTimestamp(detectCaptureUs);
+  playNote(trackedNote, pitchTrackPitch(), detectLevel);
+  midiOutFlush();
 
   commandHandler();
 
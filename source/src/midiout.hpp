@@ -0,0 +1,513 @@
+#include <Arduino.h>
+#include <atomic>
+#include <BLEMidi.h>
+
+// MIDI output shaping between the pitch tracker and BLEMidiServer. Every MIDI
+// message costs a BLE notification, so all output goes through midiNoteOn()
+// and friends: they keep a per-channel table of sounding notes and last sent
+// values and drop duplicates and no-ops, such as a note off for a note that
+// is not on. Continuous values also go through an update gate that only lets
+// a value out when it moved far enough and enough time has passed since the
+// last one. Messages are aggregated into BLE-MIDI packets and the loop flushes
+// them once per frame, so a note change with its bend and controller updates
+// costs one notification. Its messages carry the capture time of the frame
+// as their BLE-MIDI timestamp, so the receiver can remove the jitter of
+// detection and transmission. The library's transmit task on the radio core
+// builds and sends the packets, so the loop never waits for the BLE stack.
+//
+// Glide mode keeps the sounding note while the pitch slides and streams the
+// deviation as pitch bend; the note is only retriggered once the pitch leaves
+// the bend range, which is announced to the synth with RPN 0.
+//
+// Dynamics map the frame level onto a logarithmic scale: it sets the velocity
+// of each note on and is streamed during the note as breath (CC2), expression
+// (CC11) or channel aftertouch.
+#define MIDI_OUT_CHANNEL 0
+#define MIDI_OUT_MAX_DELAY_MS 5     // Longest a message waits for others in one packet
+#define GLIDE_MODE 0                // Boot default, "m glide=1" turns it on
+#define GLIDE_BEND_RANGE 2          // Semitones either way
+#define GLIDE_MIN_INTERVAL_MS 20    // Between two pitch bend messages
+#define GLIDE_MIN_DELTA_CENTS 3.0f  // Smaller changes are not sent
+
+enum DynamicsTarget : uint8_t
+{
+  DYNAMICS_OFF,
+  DYNAMICS_BREATH,
+  DYNAMICS_EXPRESSION,
+  DYNAMICS_AFTERTOUCH
+};
+
+const char *const dynamicsNames[] = {"off", "breath", "expression", "aftertouch"};
+#define DYNAMICS_COUNT (sizeof(dynamicsNames) / sizeof(dynamicsNames[0]))
+
+#define DYNAMICS_TARGET DYNAMICS_EXPRESSION
+#define DYNAMICS_VELOCITY 1          // 0 sends every note on at velocity 127
+#define DYNAMICS_MIN_INTERVAL_MS 30  // Between two dynamics messages
+#define DYNAMICS_MIN_DELTA 3         // Smaller steps wait for DYNAMICS_SETTLE_MS
+#define DYNAMICS_SETTLE_MS 250
+
+#define MIDI_CC_BREATH 2
+#define MIDI_CC_EXPRESSION 11
+
+#define PITCH_BEND_CENTRE 8192
+#define PITCH_BEND_MAX 16383
+
+#define MIDI_CHANNELS 16
+
+struct MidiOutConfig
+{
+  bool glide;
+  uint8_t bendRange;
+  uint16_t bendIntervalMs;
+  float bendDeltaCents;
+  DynamicsTarget dynamics;
+  bool velocity;
+  float dynamicsRangeDb;
+  uint16_t dynamicsIntervalMs;
+  uint8_t dynamicsDelta;
+};
+
+const MidiOutConfig defaultMidiOutConfig = {
+    GLIDE_MODE, GLIDE_BEND_RANGE, GLIDE_MIN_INTERVAL_MS, GLIDE_MIN_DELTA_CENTS,
+    DYNAMICS_TARGET, DYNAMICS_VELOCITY, DYNAMICS_RANGE_DB, DYNAMICS_MIN_INTERVAL_MS, DYNAMICS_MIN_DELTA};
+
+MidiOutConfig midiOutConfig = defaultMidiOutConfig;
+
+// Last value an update gate let through, and when
+struct UpdateGate
+{
+  bool sent;
+  int value;
+  uint32_t timeMs;
+};
+
+// True, and 'value' recorded as sent, if it differs from the last sent value
+// by at least 'minDelta' and 'intervalMs' have passed; 'force' only needs a
+// different value
+bool gateUpdate(UpdateGate &gate, int value, int minDelta, uint32_t intervalMs, uint32_t nowMs, bool force = false)
+{
+  if (gate.sent)
+  {
+    if (value == gate.value)
+      return false;
+    if (!force && (abs(value - gate.value) < minDelta || nowMs - gate.timeMs < intervalMs))
+      return false;
+  }
+  gate.sent = true;
+  gate.value = value;
+  gate.timeMs = nowMs;
+  return true;
+}
+
+struct MidiOutStats
+{
+  uint32_t bendsSent;
+  uint32_t bendsGated; // Bend updates the gate held back
+  uint32_t glideRetriggers;
+  uint32_t dynamicsSent;
+  uint32_t dynamicsGated; // Dynamics updates the gate held back
+};
+
+static MidiOutStats midiOutStats;
+static UpdateGate bendGate = {false, PITCH_BEND_CENTRE, 0};
+static UpdateGate dynamicsGate = {false, 0, 0};
+static int bendRangeSent = -1;
+
+// What the synth has been told on one channel; -1 where nothing was sent yet
+struct MidiChannelState
+{
+  uint32_t notes[4]; // Bit n set while note n sounds
+  int8_t controllers[128];
+  int8_t program;
+  int8_t pressure;
+  int16_t bend;
+};
+
+struct MidiOutputStats
+{
+  uint32_t sent;
+  uint32_t suppressed;   // Duplicates and no-ops that were not sent
+  uint32_t disconnected; // Messages while no central was connected
+  uint32_t forcedOff;    // Note offs from midiAllNotesOff()
+  uint32_t linkLosses;   // Disconnects with notes still on
+};
+
+static MidiChannelState midiChannels[MIDI_CHANNELS];
+static MidiOutputStats midiOutputStats;
+
+// Set from the NimBLE host task, handled by the next output call on the loop task
+static std::atomic<bool> midiLinkLost(false);
+
+void midiForgetState()
+{
+  memset(midiChannels, 0, sizeof(midiChannels));
+  for (MidiChannelState &channel : midiChannels)
+  {
+    memset(channel.controllers, -1, sizeof(channel.controllers));
+    channel.program = -1;
+    channel.pressure = -1;
+    channel.bend = -1;
+  }
+  bendGate.sent = false;
+  dynamicsGate.sent = false;
+  bendRangeSent = -1;
+}
+
+// Disconnect callback: the next central starts from a blank synth state
+void midiOutDisconnected()
+{
+  midiLinkLost.store(true);
+}
+
+// True if a message may go out; also applies a pending disconnect
+bool midiOutputReady()
+{
+  if (midiLinkLost.exchange(false))
+  {
+    for (const MidiChannelState &channel : midiChannels)
+    {
+      if (channel.notes[0] | channel.notes[1] | channel.notes[2] | channel.notes[3])
+      {
+        midiOutputStats.linkLosses++;
+        break;
+      }
+    }
+    midiForgetState();
+  }
+  if (BLEMidiServer.isConnected())
+    return true;
+  midiOutputStats.disconnected++;
+  return false;
+}
+
+// Counts the outcome of a deduplication check, true when the message must go out
+bool midiOutputChanged(bool changed)
+{
+  if (changed)
+    midiOutputStats.sent++;
+  else
+    midiOutputStats.suppressed++;
+  return changed;
+}
+
+bool midiNoteIsOn(uint8_t channel, int note)
+{
+  return note >= 0 && note < 128 && (midiChannels[channel].notes[note >> 5] >> (note & 31) & 1);
+}
+
+void midiNoteOn(uint8_t channel, int note, uint8_t velocity)
+{
+  if (note < 0 || note > 127 || velocity == 0 || !midiOutputReady())
+    return;
+  if (!midiOutputChanged(!midiNoteIsOn(channel, note)))
+    return;
+  midiChannels[channel].notes[note >> 5] |= 1u << (note & 31);
+  BLEMidiServer.noteOn(channel, note, velocity);
+}
+
+void midiNoteOff(uint8_t channel, int note, uint8_t velocity)
+{
+  if (!midiOutputReady() || !midiOutputChanged(midiNoteIsOn(channel, note)))
+    return;
+  midiChannels[channel].notes[note >> 5] &= ~(1u << (note & 31));
+  BLEMidiServer.noteOff(channel, note, velocity);
+}
+
+// Data entry and parameter number controllers carry RPN/NRPN sequences and
+// channel mode messages are commands, so neither is ever deduplicated
+inline bool midiControllerIsCommand(uint8_t controller)
+{
+  return controller == 6 || controller == 38 || (controller >= 96 && controller <= 101) || controller >= 120;
+}
+
+void midiControlChange(uint8_t channel, uint8_t controller, uint8_t value)
+{
+  if (!midiOutputReady())
+    return;
+  int8_t &last = midiChannels[channel].controllers[controller];
+  if (!midiOutputChanged(midiControllerIsCommand(controller) || last != (int8_t)value))
+    return;
+  last = (int8_t)value;
+  BLEMidiServer.controlChange(channel, controller, value);
+}
+
+void midiProgramChange(uint8_t channel, uint8_t program)
+{
+  if (!midiOutputReady() || !midiOutputChanged(midiChannels[channel].program != (int8_t)program))
+    return;
+  midiChannels[channel].program = (int8_t)program;
+  BLEMidiServer.programChange(channel, program);
+}
+
+void midiAfterTouch(uint8_t channel, uint8_t pressure)
+{
+  if (!midiOutputReady() || !midiOutputChanged(midiChannels[channel].pressure != (int8_t)pressure))
+    return;
+  midiChannels[channel].pressure = (int8_t)pressure;
+  BLEMidiServer.afterTouch(channel, pressure);
+}
+
+void midiPitchBend(uint8_t channel, uint16_t value)
+{
+  if (!midiOutputReady() || !midiOutputChanged(midiChannels[channel].bend != (int16_t)value))
+    return;
+  midiChannels[channel].bend = (int16_t)value;
+  BLEMidiServer.pitchBend(channel, value);
+}
+
+// Note off for every sounding note, e.g. before sleep
+void midiAllNotesOff()
+{
+  if (!midiOutputReady())
+    return;
+  for (uint8_t channel = 0; channel < MIDI_CHANNELS; channel++)
+  {
+    for (int note = 0; note < 128; note++)
+    {
+      if (midiNoteIsOn(channel, note))
+      {
+        midiNoteOff(channel, note, 0);
+        midiOutputStats.forcedOff++;
+      }
+    }
+  }
+}
+
+void midiOutSetup()
+{
+  midiForgetState();
+  BLEMidiServer.setOnDisconnectCallback(midiOutDisconnected);
+  // What playNote() sends for one frame goes out as a single packet, see midiOutFlush()
+  BLEMidiServer.setAggregation(true, MIDI_OUT_MAX_DELAY_MS);
+  if (!BLEMidiServer.startTransmitTask())
+    LOG_WARN("No MIDI transmit task, sending from the loop");
+  // Whatever the central writes is parsed away from the BLE host task
+  if (!BLEMidiServer.startReceiveTask())
+    LOG_WARN("No MIDI receive task, parsing on the BLE host task");
+}
+
+// Lets the library follow the connection (retries of the interval request,
+// packet size from the MTU) and logs the negotiated values when they change
+void midiOutUpdate()
+{
+  static float reportedIntervalMs = 0.0f;
+  static uint16_t reportedMtu = 0;
+
+  BLEMidiServer.update();
+  float intervalMs = BLEMidiServer.getConnectionIntervalMs();
+  uint16_t mtu = BLEMidiServer.getMTU();
+  if (intervalMs != reportedIntervalMs || mtu != reportedMtu)
+  {
+    reportedIntervalMs = intervalMs;
+    reportedMtu = mtu;
+    if (BLEMidiServer.isConnected())
+      LOG_INFO("BLE connection: interval %.2f ms, latency %u, MTU %u", intervalMs,
+               (uint32_t)BLEMidiServer.getConnectionLatency(), (uint32_t)mtu);
+  }
+}
+
+// Stamps the following messages with 'captureUs' (esp_timer_get_time()
+// clock) until midiOutFlush(), instead of when they are sent
+void midiOutTimestamp(int64_t captureUs)
+{
+  BLEMidiServer.setTimestamp((uint32_t)(captureUs / 1000));
+}
+
+// Hands the messages collected since the last call to the transmit task,
+// which sends them in one BLE notification. Every path out (notes, bend, CC11,
+// all notes off) ends here, so this is where the BLE power lock is held
+void midiOutFlush()
+{
+  powerBeginBle();
+  BLEMidiServer.flush();
+  BLEMidiServer.clearTimestamp();
+  powerEndBle();
+}
+
+// Announces the bend range with RPN 0 (pitch bend sensitivity), then closes the RPN
+void sendBendRange(uint8_t channel, uint8_t semitones)
+{
+  midiControlChange(channel, 101, 0);
+  midiControlChange(channel, 100, 0);
+  midiControlChange(channel, 6, semitones);
+  midiControlChange(channel, 38, 0);
+  midiControlChange(channel, 101, 127);
+  midiControlChange(channel, 100, 127);
+  bendRangeSent = semitones;
+}
+
+// The note to sound for 'trackedNote' while 'soundingNote' is on: in glide
+// mode the sounding note is kept as long as 'pitch' is within the bend range
+int glideNote(int trackedNote, int soundingNote, float pitch)
+{
+  if (!midiOutConfig.glide || trackedNote < 0 || soundingNote < 0 || trackedNote == soundingNote)
+    return trackedNote;
+  if (fabsf(pitch - soundingNote) < midiOutConfig.bendRange)
+    return soundingNote;
+  midiOutStats.glideRetriggers++;
+  return trackedNote;
+}
+
+// Sends the deviation of 'pitch' from 'note' as pitch bend if the gate lets
+// it through; 'force' skips the rate limit, e.g. just before a note on
+void glideBend(int note, float pitch, uint32_t nowMs, bool force = false)
+{
+  if (!midiOutConfig.glide)
+    return;
+  if (bendRangeSent != midiOutConfig.bendRange)
+    sendBendRange(MIDI_OUT_CHANNEL, midiOutConfig.bendRange);
+
+  float deviation = (pitch - note) / midiOutConfig.bendRange;
+  int value = PITCH_BEND_CENTRE + (int)lroundf(deviation * PITCH_BEND_CENTRE);
+  value = max(0, min(value, PITCH_BEND_MAX));
+  int minDelta = (int)(midiOutConfig.bendDeltaCents / 100.0f / midiOutConfig.bendRange * PITCH_BEND_CENTRE);
+  if (gateUpdate(bendGate, value, minDelta, midiOutConfig.bendIntervalMs, nowMs, force))
+  {
+    midiPitchBend(MIDI_OUT_CHANNEL, (uint16_t)value);
+    midiOutStats.bendsSent++;
+  }
+  else if (value != bendGate.value)
+  {
+    midiOutStats.bendsGated++;
+  }
+}
+
+// Returns the bend to the centre once the note has ended
+void glideCentre(uint32_t nowMs)
+{
+  if (gateUpdate(bendGate, PITCH_BEND_CENTRE, 0, 0, nowMs, true))
+  {
+    midiPitchBend(MIDI_OUT_CHANNEL, (uint16_t)PITCH_BEND_CENTRE);
+    midiOutStats.bendsSent++;
+  }
+}
+
+// 1..127 for 'level' (0..1) over the configured range, see quantizeLevel()
+int levelToMidi(float level)
+{
+  return quantizeLevel(level, midiOutConfig.dynamicsRangeDb);
+}
+
+uint8_t noteVelocity(float level)
+{
+  return midiOutConfig.velocity ? (uint8_t)levelToMidi(level) : 127;
+}
+
+// Streams 'level' as the configured controller. Steps of at least
+// dynamicsDelta go out at most every dynamicsIntervalMs; smaller ones once the
+// last message is DYNAMICS_SETTLE_MS old, so a slow swell still arrives.
+// 'force' sends any change at once, e.g. just before a note on.
+void dynamicsUpdate(float level, uint32_t nowMs, bool force = false)
+{
+  if (midiOutConfig.dynamics == DYNAMICS_OFF)
+    return;
+
+  int value = levelToMidi(level);
+  bool due = gateUpdate(dynamicsGate, value, midiOutConfig.dynamicsDelta, midiOutConfig.dynamicsIntervalMs,
+                        nowMs, force);
+  if (!due && nowMs - dynamicsGate.timeMs >= DYNAMICS_SETTLE_MS)
+    due = gateUpdate(dynamicsGate, value, 0, 0, nowMs, true);
+  if (!due)
+  {
+    if (value != dynamicsGate.value)
+      midiOutStats.dynamicsGated++;
+    return;
+  }
+
+  switch (midiOutConfig.dynamics)
+  {
+  case DYNAMICS_BREATH:
+    midiControlChange(MIDI_OUT_CHANNEL, MIDI_CC_BREATH, value);
+    break;
+  case DYNAMICS_EXPRESSION:
+    midiControlChange(MIDI_OUT_CHANNEL, MIDI_CC_EXPRESSION, value);
+    break;
+  default:
+    midiAfterTouch(MIDI_OUT_CHANNEL, value);
+    break;
+  }
+  midiOutStats.dynamicsSent++;
+}
+
+// Applies "key=value" settings from 'line' to 'config': glide (0 or 1), range,
+// interval and delta for glide; dynamics (off, breath, expression or
+// aftertouch), velocity (0 or 1), db, dyninterval and dyndelta for dynamics.
+// Returns NULL, or the first setting it could not parse.
+const char *parseMidiOutConfig(const char *line, MidiOutConfig &config)
+{
+  static char error[48];
+  char buffer[128];
+  strncpy(buffer, line, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = '\0';
+
+  char *save = NULL;
+  for (char *token = strtok_r(buffer, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save))
+  {
+    char *value = strchr(token, '=');
+    char *end = NULL;
+    float number = 0.0f;
+    bool ok = value != NULL;
+    if (ok)
+    {
+      *value++ = '\0';
+      number = strtof(value, &end);
+      ok = end != value && *end == '\0' && number >= 0.0f;
+    }
+    int dynamics = value != NULL ? findName(value, dynamicsNames, DYNAMICS_COUNT) : -1;
+    if (strcmp(token, "dynamics") == 0 && dynamics >= 0)
+      config.dynamics = (DynamicsTarget)dynamics;
+    else if (ok && strcmp(token, "glide") == 0 && number <= 1.0f)
+      config.glide = number != 0.0f;
+    else if (ok && strcmp(token, "range") == 0 && number >= 1.0f && number <= 24.0f)
+      config.bendRange = (uint8_t)number;
+    else if (ok && strcmp(token, "interval") == 0 && number <= 1000.0f)
+      config.bendIntervalMs = (uint16_t)number;
+    else if (ok && strcmp(token, "delta") == 0 && number <= 100.0f)
+      config.bendDeltaCents = number;
+    else if (ok && strcmp(token, "velocity") == 0 && number <= 1.0f)
+      config.velocity = number != 0.0f;
+    else if (ok && strcmp(token, "db") == 0 && number >= 6.0f && number <= 120.0f)
+      config.dynamicsRangeDb = number;
+    else if (ok && strcmp(token, "dyninterval") == 0 && number <= 1000.0f)
+      config.dynamicsIntervalMs = (uint16_t)number;
+    else if (ok && strcmp(token, "dyndelta") == 0 && number <= 127.0f)
+      config.dynamicsDelta = (uint8_t)number;
+    else
+    {
+      snprintf(error, sizeof(error), "cannot parse '%s'", token);
+      return error;
+    }
+  }
+  return NULL;
+}
+
+void printMidiOut()
+{
+  Serial.printf("MIDI out: glide=%d range=%d interval=%u delta=%.1f\r\n", midiOutConfig.glide,
+                midiOutConfig.bendRange, midiOutConfig.bendIntervalMs, midiOutConfig.bendDeltaCents);
+  Serial.printf("  dynamics=%s velocity=%d db=%.0f dyninterval=%u dyndelta=%u\r\n",
+                dynamicsNames[midiOutConfig.dynamics], midiOutConfig.velocity, midiOutConfig.dynamicsRangeDb,
+                midiOutConfig.dynamicsIntervalMs, midiOutConfig.dynamicsDelta);
+  Serial.printf("  pitch bends sent %u, gated %u, glide retriggers %u\r\n", midiOutStats.bendsSent,
+                midiOutStats.bendsGated, midiOutStats.glideRetriggers);
+  Serial.printf("  dynamics sent %u, gated %u\r\n", midiOutStats.dynamicsSent, midiOutStats.dynamicsGated);
+  Serial.printf("  messages sent %u, suppressed %u, while disconnected %u, forced note offs %u, link losses %u\r\n",
+                midiOutputStats.sent, midiOutputStats.suppressed, midiOutputStats.disconnected,
+                midiOutputStats.forcedOff, midiOutputStats.linkLosses);
+  Serial.printf("  BLE packets %u for %u messages\r\n", BLEMidiServer.getPacketsSent(), BLEMidiServer.getMessagesSent());
+  MidiTxStats tx = BLEMidiServer.getTxStats();
+  Serial.printf("  transmit queue: %u queued, %u overflows, %u refused notifications, high water %u of %d\r\n",
+                tx.queued, tx.overflows, tx.congestion, tx.highWater, MIDI_TX_QUEUE_SIZE);
+  MidiRxStats rx = BLEMidiServer.getRxStats();
+  Serial.printf("  receive queue: %u packets, %u dropped, high water %u of %d\r\n", rx.received, rx.dropped,
+                rx.highWater, MIDI_RX_QUEUE_SIZE);
+  Serial.printf("  connection: interval %.2f ms, latency %u, timeout %u ms, MTU %u, %u parameter requests\r\n",
+                BLEMidiServer.getConnectionIntervalMs(), BLEMidiServer.getConnectionLatency(),
+                BLEMidiServer.getSupervisionTimeoutMs(), BLEMidiServer.getMTU(), BLEMidiServer.getConnectionRequests());
+}
+
+void resetMidiOutStats()
+{
+  memset(&midiOutStats, 0, sizeof(midiOutStats));
+  memset(&midiOutputStats, 0, sizeof(midiOutputStats));
+}
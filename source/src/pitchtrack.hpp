@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// Pitch tracking between detection and MIDI output. The held note only changes
+// once the detected pitch is PITCH_HYSTERESIS_CENTS past the semitone boundary,
+// and then goes straight to the detected note, so a leap sends one note on. The
+// pitch is also smoothed in semitones with a one-euro filter, which follows
+// fast leaps with little lag but damps the jitter of a held note; only the bend
+// and glide output use it. With PITCH_RELEASE_FRAMES above 0, dropouts of up to that many
+// unvoiced frames keep the note sounding, at the price of ending every note
+// that much later; by default a note ends with its first unvoiced frame.
+#define PITCH_MIN_CUTOFF 1.0f         // Hz, smoothing of a steady pitch
+#define PITCH_BETA 0.05f              // Cutoff increase per semitone/s of pitch change
+#define PITCH_DERIVATIVE_CUTOFF 1.0f  // Hz, smoothing of the pitch change rate
+#define PITCH_HYSTERESIS_CENTS 20.0f  // Beyond the 50 cent boundary
+#define PITCH_RELEASE_FRAMES 0        // Unvoiced frames bridged before the note ends
+
+struct PitchTrackConfig
+{
+  float minCutoff;
+  float beta;
+  float derivativeCutoff;
+  float hysteresisCents;
+  int releaseFrames;
+};
+
+const PitchTrackConfig defaultPitchTrackConfig = {
+    PITCH_MIN_CUTOFF, PITCH_BETA, PITCH_DERIVATIVE_CUTOFF, PITCH_HYSTERESIS_CENTS, PITCH_RELEASE_FRAMES};
+
+PitchTrackConfig pitchTrackConfig = defaultPitchTrackConfig;
+
+struct PitchTrackStats
+{
+  uint32_t frames;
+  uint32_t rawChanges;           // Frames whose nearest note differs from the previous voiced frame
+  uint32_t noteChanges;          // Changes of the tracked note, including note on and off
+  uint32_t suppressedChanges;    // Raw changes the tracker did not pass on
+  uint32_t bridgedDropouts;      // Gaps of unvoiced frames the note was held through
+};
+
+static PitchTrackStats pitchTrackStats;
+
+struct PitchTrackState
+{
+  bool active;
+  float pitch;       // Smoothed pitch in fractional MIDI notes
+  float derivative;  // Smoothed change rate in semitones per second
+  uint32_t lastUs;   // End of the last voiced frame
+  int rawNote;       // Nearest note of the last voiced frame
+  int note;          // Tracked note, -1 when silent
+  int unvoiced;      // Consecutive unvoiced frames
+};
+
+static PitchTrackState pitchTrackState = {false, 0.0f, 0.0f, 0, -1, -1, 0};
+
+// Smoothing factor of a first-order low-pass at 'cutoff' Hz over 'dt' seconds
+inline float pitchSmoothing(float cutoff, float dt)
+{
+  float tau = 1.0f / (2.0f * (float)M_PI * cutoff);
+  return 1.0f / (1.0f + tau / dt);
+}
+
+// Smoothed pitch of the last voiced frame in fractional MIDI notes
+inline float pitchTrackPitch()
+{
+  return pitchTrackState.pitch;
+}
+
+void resetPitchTrack()
+{
+  pitchTrackState = {false, 0.0f, 0.0f, 0, -1, -1, 0};
+}
+
+void resetPitchTrackStats()
+{
+  memset(&pitchTrackStats, 0, sizeof(pitchTrackStats));
+}
+
+// Feeds one analysed frame that ended at 'timeUs' microseconds, with
+// 'frequency' 0 when unvoiced. Returns the MIDI note to sound, or -1 for silence.
+int pitchTrackUpdate(float frequency, uint32_t timeUs)
+{
+  PitchTrackState &state = pitchTrackState;
+  const PitchTrackConfig &config = pitchTrackConfig;
+  pitchTrackStats.frames++;
+  int previousNote = state.note;
+
+  // Fractional MIDI note from the boundary table, without a logarithm per frame
+  QuantizedNote quantized = frequency > 0.0f ? quantizeFrequency(frequency) : QuantizedNote{-1, 0, 0, ""};
+
+  if (quantized.midi < 0)
+  {
+    if (state.note >= 0 && ++state.unvoiced <= config.releaseFrames)
+      return state.note;
+    if (state.note >= 0)
+      pitchTrackStats.noteChanges++;
+    state.active = false;
+    state.rawNote = -1;
+    state.note = -1;
+    return -1;
+  }
+
+  float pitch = quantized.midi + quantized.cents / 100.0f;
+  int rawNote = quantized.midi;
+  // Only a gap the note sounds on after counts as a bridged dropout, not the end of a note
+  if (state.unvoiced > 0 && state.note >= 0)
+    pitchTrackStats.bridgedDropouts++;
+  state.unvoiced = 0;
+
+  if (!state.active)
+  {
+    // A new onset starts from the raw pitch instead of gliding from the last note
+    state.active = true;
+    state.pitch = pitch;
+    state.derivative = 0.0f;
+  }
+  else
+  {
+    // Unsigned difference, so the microsecond counter may wrap
+    float dt = (timeUs - state.lastUs) / 1e6f;
+    if (dt <= 0.0f)
+      dt = 1e-3f;
+    float derivative = (pitch - state.pitch) / dt;
+    state.derivative += pitchSmoothing(config.derivativeCutoff, dt) * (derivative - state.derivative);
+    float cutoff = config.minCutoff + config.beta * fabsf(state.derivative);
+    state.pitch += pitchSmoothing(cutoff, dt) * (pitch - state.pitch);
+  }
+  state.lastUs = timeUs;
+
+  if (state.note < 0 || fabsf(pitch - state.note) > 0.5f + config.hysteresisCents / 100.0f)
+    state.note = rawNote;
+
+  if (state.rawNote >= 0 && rawNote != state.rawNote)
+  {
+    pitchTrackStats.rawChanges++;
+    if (state.note == previousNote)
+      pitchTrackStats.suppressedChanges++;
+  }
+  if (state.note != previousNote)
+    pitchTrackStats.noteChanges++;
+  state.rawNote = rawNote;
+  return state.note;
+}
+
+// Applies "key=value" settings from 'line' to 'config': cutoff, beta, dcutoff,
+// hysteresis and release. Returns NULL, or the first setting it could not parse.
+const char *parsePitchTrackConfig(const char *line, PitchTrackConfig &config)
+{
+  static char error[48];
+  char buffer[128];
+  strncpy(buffer, line, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = '\0';
+
+  char *save = NULL;
+  for (char *token = strtok_r(buffer, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save))
+  {
+    char *value = strchr(token, '=');
+    char *end = NULL;
+    float number = 0.0f;
+    bool ok = value != NULL;
+    if (ok)
+    {
+      *value++ = '\0';
+      number = strtof(value, &end);
+      ok = end != value && *end == '\0' && number >= 0.0f;
+    }
+    if (ok && strcmp(token, "cutoff") == 0 && number > 0.0f)
+      config.minCutoff = number;
+    else if (ok && strcmp(token, "beta") == 0)
+      config.beta = number;
+    else if (ok && strcmp(token, "dcutoff") == 0 && number > 0.0f)
+      config.derivativeCutoff = number;
+    else if (ok && strcmp(token, "hysteresis") == 0 && number < 50.0f)
+      config.hysteresisCents = number;
+    else if (ok && strcmp(token, "release") == 0)
+      config.releaseFrames = (int)number;
+    else
+    {
+      snprintf(error, sizeof(error), "cannot parse '%s'", token);
+      return error;
+    }
+  }
+  return NULL;
+}
+
+// Writes 'config' in the form parsePitchTrackConfig() reads
+void formatPitchTrackConfig(const PitchTrackConfig &config, char *line, size_t size)
+{
+  snprintf(line, size, "cutoff=%.2f beta=%.3f dcutoff=%.2f hysteresis=%.0f release=%d", config.minCutoff,
+           config.beta, config.derivativeCutoff, config.hysteresisCents, config.releaseFrames);
+}
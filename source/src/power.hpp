@@ -0,0 +1,205 @@
+#include <Arduino.h>
+
+#include <esp_pm.h>
+
+// Power management: dynamic frequency scaling between POWER_MIN_CPU_MHZ and
+// POWER_MAX_CPU_MHZ, with the clock held at maximum only around DSP bursts and
+// BLE sends. Needs CONFIG_PM_ENABLE in the framework's sdkconfig; without it the
+// CPU simply runs at the configured maximum clock.
+#define POWER_MANAGEMENT 1
+#define POWER_MAX_CPU_MHZ 240
+#define POWER_MIN_CPU_MHZ 80
+// Allow automatic light sleep when no lock is held. It only happens with
+// CONFIG_FREERTOS_USE_TICKLESS_IDLE, and never while the I2S DMA, the WiFi
+// access point or a BLE controller without modem sleep holds its own lock.
+#define POWER_LIGHT_SLEEP 1
+
+// After this many frames without a note the audio path counts as silent and
+// detect_loop() duty-cycles the microphone: I2S is stopped for
+// POWER_SILENCE_SLEEP_MS between probe frames so the chip can sleep. Adds up to
+// that much onset latency after silence; 0 disables it.
+#define POWER_SILENCE_FRAMES 60
+#define POWER_SILENCE_SLEEP_MS 40
+
+// Processing time per frame at each maximum clock, to check the latency budget
+struct PowerHeadroom
+{
+  uint32_t frames;
+  uint32_t maxUs;
+  uint64_t totalUs;
+  uint32_t framePeriodUs; // Capture time of the frames, the processing budget
+};
+
+const int powerClocks[] = {80, 160, 240};
+#define POWER_CLOCK_COUNT (sizeof(powerClocks) / sizeof(powerClocks[0]))
+
+static PowerHeadroom powerHeadroom[POWER_CLOCK_COUNT] = {};
+static int powerMaxMhz = POWER_MAX_CPU_MHZ;
+static uint32_t powerSilentFrames = 0;
+static uint32_t powerSilenceSleeps = 0;
+
+#if POWER_MANAGEMENT && CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t dspLock = NULL;   // CPU at max clock during DSP bursts
+static esp_pm_lock_handle_t bleLock = NULL;   // CPU at max clock while sending MIDI
+static esp_pm_lock_handle_t audioLock = NULL; // No light sleep unless silent
+static bool audioLockHeld = false;
+#endif
+
+// Apply 'maxMhz' as the top of the frequency scaling range
+bool powerSetMaxClock(int maxMhz)
+{
+#if POWER_MANAGEMENT && CONFIG_PM_ENABLE
+  esp_pm_config_esp32_t config = {
+      .max_freq_mhz = maxMhz,
+      .min_freq_mhz = min(POWER_MIN_CPU_MHZ, maxMhz),
+#if POWER_LIGHT_SLEEP && CONFIG_FREERTOS_USE_TICKLESS_IDLE
+      .light_sleep_enable = true
+#else
+      .light_sleep_enable = false
+#endif
+  };
+  esp_err_t result = esp_pm_configure(&config);
+  if (result != ESP_OK)
+  {
+    Serial.printf("esp_pm_configure(%d MHz) failed: %d\r\n", maxMhz, result);
+    return false;
+  }
+#else
+  if (!setCpuFrequencyMhz(maxMhz))
+  {
+    Serial.printf("Cannot set CPU clock to %d MHz\r\n", maxMhz);
+    return false;
+  }
+#endif
+  powerMaxMhz = maxMhz;
+  return true;
+}
+
+// Switch to the next maximum clock, to compare the headroom at each of them
+void powerCycleMaxClock()
+{
+  size_t next = 0;
+  for (size_t i = 0; i < POWER_CLOCK_COUNT; i++)
+  {
+    if (powerClocks[i] == powerMaxMhz)
+      next = (i + 1) % POWER_CLOCK_COUNT;
+  }
+  if (powerSetMaxClock(powerClocks[next]))
+    Serial.printf("Maximum CPU clock: %d MHz\r\n", powerMaxMhz);
+}
+
+void powerSetup()
+{
+#if POWER_MANAGEMENT && CONFIG_PM_ENABLE
+  esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "dsp", &dspLock);
+  esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "ble", &bleLock);
+  esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "audio", &audioLock);
+  esp_pm_lock_acquire(audioLock);
+  audioLockHeld = true;
+  Serial.printf("Power management: %d-%d MHz", POWER_MIN_CPU_MHZ, POWER_MAX_CPU_MHZ);
+#if POWER_LIGHT_SLEEP && CONFIG_FREERTOS_USE_TICKLESS_IDLE
+  Serial.print(", light sleep");
+#endif
+  Serial.println();
+#else
+  Serial.printf("Power management not available, CPU fixed at %d MHz\r\n", POWER_MAX_CPU_MHZ);
+#endif
+  powerSetMaxClock(POWER_MAX_CPU_MHZ);
+}
+
+// Brackets a DSP burst; the locks are counted, so tasks on both cores may nest them
+void powerBeginDsp()
+{
+#if POWER_MANAGEMENT && CONFIG_PM_ENABLE
+  esp_pm_lock_acquire(dspLock);
+#endif
+}
+
+void powerEndDsp()
+{
+#if POWER_MANAGEMENT && CONFIG_PM_ENABLE
+  esp_pm_lock_release(dspLock);
+#endif
+}
+
+// Brackets a burst of BLE MIDI traffic
+void powerBeginBle()
+{
+#if POWER_MANAGEMENT && CONFIG_PM_ENABLE
+  esp_pm_lock_acquire(bleLock);
+#endif
+}
+
+void powerEndBle()
+{
+#if POWER_MANAGEMENT && CONFIG_PM_ENABLE
+  esp_pm_lock_release(bleLock);
+#endif
+}
+
+// Account one analysed frame, captured over 'framePeriodUs', that took
+// 'processingUs' to process
+void powerFrameDone(bool noteDetected, uint32_t framePeriodUs, uint32_t processingUs)
+{
+  for (size_t i = 0; i < POWER_CLOCK_COUNT; i++)
+  {
+    if (powerClocks[i] != powerMaxMhz)
+      continue;
+    PowerHeadroom &headroom = powerHeadroom[i];
+    headroom.frames++;
+    headroom.totalUs += processingUs;
+    if (processingUs > headroom.maxUs)
+      headroom.maxUs = processingUs;
+    headroom.framePeriodUs = framePeriodUs;
+  }
+
+  if (noteDetected)
+  {
+    powerSilentFrames = 0;
+#if POWER_MANAGEMENT && CONFIG_PM_ENABLE
+    if (!audioLockHeld)
+    {
+      esp_pm_lock_acquire(audioLock);
+      audioLockHeld = true;
+    }
+#endif
+  }
+  else if (powerSilentFrames < POWER_SILENCE_FRAMES)
+  {
+    powerSilentFrames++;
+  }
+}
+
+bool powerIsSilent()
+{
+  return powerSilentFrames >= POWER_SILENCE_FRAMES;
+}
+
+// Called before the audio path stops the microphone during silence
+void powerEnterSilenceSleep()
+{
+#if POWER_MANAGEMENT && CONFIG_PM_ENABLE
+  if (audioLockHeld)
+  {
+    esp_pm_lock_release(audioLock);
+    audioLockHeld = false;
+  }
+#endif
+  powerSilenceSleeps++;
+}
+
+void printPowerStats()
+{
+  Serial.printf("CPU clock: %d MHz now, %d MHz maximum\r\n", getCpuFrequencyMhz(), powerMaxMhz);
+  Serial.printf("  Silent: %s, silence sleeps: %u\r\n", powerIsSilent() ? "yes" : "no", powerSilenceSleeps);
+  for (size_t i = 0; i < POWER_CLOCK_COUNT; i++)
+  {
+    const PowerHeadroom &headroom = powerHeadroom[i];
+    if (headroom.frames == 0)
+      continue;
+    uint32_t meanUs = (uint32_t)(headroom.totalUs / headroom.frames);
+    Serial.printf("  %3d MHz: %u frames, mean %u us, max %u us, headroom %d us of %u us\r\n",
+                  powerClocks[i], headroom.frames, meanUs, headroom.maxUs,
+                  (int)headroom.framePeriodUs - (int)headroom.maxUs, headroom.framePeriodUs);
+  }
+}
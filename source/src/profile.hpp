@@ -0,0 +1,123 @@
+#include <Arduino.h>
+
+// Per-stage profiling of the detection pipeline with the CPU cycle counter.
+// Each stage keeps min/mean/max and a log-scale histogram for percentiles;
+// the 'p' serial command dumps and resets them. Cycle counts are per core and
+// count work rather than time when the clock is scaled.
+#define PROFILING 1
+
+enum ProfileStageId
+{
+  PROFILE_I2S_WAIT,
+  PROFILE_CONVERSION,
+  PROFILE_HIGH_PASS,
+  PROFILE_RMS,
+  PROFILE_WINDOWING,
+  PROFILE_FFT,
+  PROFILE_MAGNITUDE,
+  PROFILE_PEAK_SEARCH,
+  PROFILE_QUANTIZATION,
+  PROFILE_STAGE_COUNT
+};
+
+const char *const profileStageNames[PROFILE_STAGE_COUNT] = {
+    "i2s wait", "conversion", "high-pass", "rms", "windowing",
+    "fft", "magnitude", "peak search", "quantization"};
+
+// Four histogram buckets per octave of cycles, about 19% wide each
+#define PROFILE_SUB_BUCKET_BITS 2
+#define PROFILE_BUCKETS (32 << PROFILE_SUB_BUCKET_BITS)
+
+struct ProfileStage
+{
+  uint32_t count;
+  uint32_t minCycles;
+  uint32_t maxCycles;
+  uint64_t totalCycles;
+  uint32_t histogram[PROFILE_BUCKETS];
+};
+
+static ProfileStage profileStages[PROFILE_STAGE_COUNT];
+
+// Bucket index: the position of the top bit plus the next PROFILE_SUB_BUCKET_BITS bits
+inline uint32_t profileBucket(uint32_t cycles)
+{
+  if (cycles < (1u << PROFILE_SUB_BUCKET_BITS))
+    return cycles;
+  uint32_t exponent = 31 - __builtin_clz(cycles);
+  uint32_t mantissa = (cycles >> (exponent - PROFILE_SUB_BUCKET_BITS)) & ((1u << PROFILE_SUB_BUCKET_BITS) - 1);
+  return ((exponent - PROFILE_SUB_BUCKET_BITS + 1) << PROFILE_SUB_BUCKET_BITS) + mantissa;
+}
+
+// Largest cycle count that falls into 'bucket'
+inline uint32_t profileBucketLimit(uint32_t bucket)
+{
+  if (bucket < (1u << PROFILE_SUB_BUCKET_BITS))
+    return bucket;
+  uint32_t exponent = (bucket >> PROFILE_SUB_BUCKET_BITS) + PROFILE_SUB_BUCKET_BITS - 1;
+  uint32_t mantissa = bucket & ((1u << PROFILE_SUB_BUCKET_BITS) - 1);
+  uint64_t base = ((uint64_t)((1u << PROFILE_SUB_BUCKET_BITS) + mantissa + 1)) << (exponent - PROFILE_SUB_BUCKET_BITS);
+  return base > 0xFFFFFFFFull ? 0xFFFFFFFFu : (uint32_t)(base - 1);
+}
+
+inline void profileAccumulate(ProfileStage &stage, uint32_t cycles)
+{
+  if (stage.count == 0 || cycles < stage.minCycles)
+    stage.minCycles = cycles;
+  if (cycles > stage.maxCycles)
+    stage.maxCycles = cycles;
+  stage.count++;
+  stage.totalCycles += cycles;
+  stage.histogram[profileBucket(cycles)]++;
+}
+
+inline void profileRecord(ProfileStageId id, uint32_t cycles)
+{
+  profileAccumulate(profileStages[id], cycles);
+}
+
+#if PROFILING
+#define PROFILE_BEGIN(stage) uint32_t profileStart_##stage = ESP.getCycleCount()
+#define PROFILE_END(stage) profileRecord(stage, ESP.getCycleCount() - profileStart_##stage)
+#else
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(stage)
+#endif
+
+// Smallest bucket limit below which 'fraction' of the samples fall
+uint32_t profilePercentile(const ProfileStage &stage, float fraction)
+{
+  uint32_t target = (uint32_t)(fraction * stage.count + 0.5f);
+  uint32_t seen = 0;
+  for (uint32_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++)
+  {
+    seen += stage.histogram[bucket];
+    if (seen >= target && seen > 0)
+      return min(profileBucketLimit(bucket), stage.maxCycles);
+  }
+  return stage.maxCycles;
+}
+
+// Prints the stages in microseconds at 'cpuMhz', the clock the DSP runs at
+void printProfile(int cpuMhz)
+{
+  float cyclesPerUs = (float)cpuMhz;
+
+  Serial.printf("Profile (us at %d MHz)  count      min     mean      p99      max\r\n", (int)cyclesPerUs);
+  for (int id = 0; id < PROFILE_STAGE_COUNT; id++)
+  {
+    const ProfileStage &stage = profileStages[id];
+    if (stage.count == 0)
+      continue;
+    Serial.printf("  %-20s %6u %8.1f %8.1f %8.1f %8.1f\r\n", profileStageNames[id], stage.count,
+                  stage.minCycles / cyclesPerUs,
+                  (float)stage.totalCycles / stage.count / cyclesPerUs,
+                  profilePercentile(stage, 0.99f) / cyclesPerUs,
+                  stage.maxCycles / cyclesPerUs);
+  }
+}
+
+void resetProfile()
+{
+  memset(profileStages, 0, sizeof(profileStages));
+}
@@ -0,0 +1,85 @@
+#include <math.h>
+#include <stdint.h>
+#include <array>
+#include <algorithm>
+
+// Concert pitch of A4 (MIDI note 69) the note boundaries are generated for
+#define NOTE_A4_REFERENCE 440.0
+
+#define MIDI_NOTE_COUNT 128
+
+// A frequency quantized to the nearest MIDI note
+struct QuantizedNote
+{
+  int8_t midi;      // 0..127, or -1 when the frequency is outside the MIDI range
+  int8_t octave;    // Scientific pitch notation, C4 = MIDI 60
+  int8_t cents;     // -50..+50 from the centre of the note
+  const char *name; // "C", "C#", ... from static storage
+};
+
+const char *const noteNames[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+
+// 2^(1/24): a quarter tone, the distance from a note centre to its boundary
+constexpr double QUARTER_TONE = 1.0293022366434921;
+
+constexpr double quarterTonePower(int exponent)
+{
+  double factor = exponent < 0 ? 1.0 / QUARTER_TONE : QUARTER_TONE;
+  int count = exponent < 0 ? -exponent : exponent;
+  double result = 1.0;
+  for (int i = 0; i < count; i++)
+    result *= factor;
+  return result;
+}
+
+// Entry n is the lower boundary of MIDI note n, a quarter tone below its
+// centre; entry 128 is the upper boundary of note 127
+constexpr std::array<float, MIDI_NOTE_COUNT + 1> makeNoteBoundaries(double a4)
+{
+  std::array<float, MIDI_NOTE_COUNT + 1> boundaries = {};
+  for (int note = 0; note <= MIDI_NOTE_COUNT; note++)
+    boundaries[note] = (float)(a4 * quarterTonePower(2 * (note - 69) - 1));
+  return boundaries;
+}
+
+constexpr std::array<float, MIDI_NOTE_COUNT + 1> noteBoundaries = makeNoteBoundaries(NOTE_A4_REFERENCE);
+
+// Natural logarithm of one semitone, ln(2) / 12
+#define LN_SEMITONE 0.0577622650f
+
+// Binary search of the boundary table: no logarithms and no heap allocation.
+// Inside the semitone, cents come from a cubic series for ln(1 + x), which is
+// exact to a few thousandths of a cent for x below 2^(1/12) - 1.
+inline QuantizedNote quantizeFrequency(float frequency)
+{
+  QuantizedNote note = {-1, 0, 0, ""};
+  if (!(frequency >= noteBoundaries[0]) || frequency >= noteBoundaries[MIDI_NOTE_COUNT])
+    return note;
+
+  // First boundary above the frequency is the upper boundary of its note
+  const float *upper = std::upper_bound(noteBoundaries.begin(), noteBoundaries.end(), frequency);
+  int midi = (int)(upper - noteBoundaries.begin()) - 1;
+  float lower = noteBoundaries[midi];
+
+  note.midi = midi;
+  note.octave = midi / 12 - 1;
+  note.name = noteNames[midi % 12];
+  float x = (frequency - lower) / lower;
+  float cents = 100.0f * (x - x * x * (0.5f - x * (1.0f / 3.0f))) / LN_SEMITONE - 50.0f;
+  note.cents = (int8_t)(cents < 0.0f ? cents - 0.5f : cents + 0.5f);
+  return note;
+}
+
+// Level range, in dB below full level, spread over the MIDI values 1..127
+#define DYNAMICS_RANGE_DB 40.0f
+
+// 1..127 for 'level' (0..1), with the top 'rangeDb' of the level spread over
+// the MIDI range and anything quieter at 1
+inline int quantizeLevel(float level, float rangeDb)
+{
+  if (!(level > 0.0f))
+    return 1;
+  float db = 20.0f * log10f(level);
+  int value = (int)lroundf(127.0f * (1.0f + db / rangeDb));
+  return std::max(1, std::min(value, 127));
+}